@@ -0,0 +1,664 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <zlib.h>
+
+#if (NGX_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+
+#define NGX_HTTP_DECOMPRESS_GZIP     1
+#define NGX_HTTP_DECOMPRESS_DEFLATE  2
+#define NGX_HTTP_DECOMPRESS_ZSTD     3
+
+
+typedef struct {
+    ngx_flag_t                 enable;
+    off_t                      max_size;
+    size_t                     zstd_window;
+} ngx_http_body_decompress_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                 type;
+    ngx_table_elt_t           *encoding;
+
+    z_stream                   zstream;
+#if (NGX_HAVE_ZSTD)
+    ZSTD_DStream              *dstream;
+#endif
+
+    ngx_buf_t                 *out;
+    size_t                     size;
+    off_t                      total;
+    off_t                      max_size;
+
+    unsigned                   pass:1;
+    unsigned                   started:1;
+    unsigned                   done:1;
+} ngx_http_body_decompress_ctx_t;
+
+
+static ngx_int_t ngx_http_body_decompress_filter(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static ngx_uint_t ngx_http_body_decompress_used(ngx_http_request_t *r);
+static ngx_int_t ngx_http_body_decompress_start(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b);
+static ngx_int_t ngx_http_body_decompress_inflate(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b);
+#if (NGX_HAVE_ZSTD)
+static ngx_int_t ngx_http_body_decompress_zstd(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b);
+#endif
+static ngx_int_t ngx_http_body_decompress_output(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, size_t n);
+static ngx_int_t ngx_http_body_decompress_get_buf(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx);
+static ngx_table_elt_t *ngx_http_body_decompress_encoding(
+    ngx_http_request_t *r);
+static void ngx_http_body_decompress_cleanup(void *data);
+
+static void *ngx_http_body_decompress_create_conf(ngx_conf_t *cf);
+static char *ngx_http_body_decompress_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_http_body_decompress_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_body_decompress_commands[] = {
+
+    { ngx_string("client_body_decompress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_decompress_conf_t, enable),
+      NULL },
+
+    { ngx_string("client_body_decompress_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_decompress_conf_t, max_size),
+      NULL },
+
+    { ngx_string("client_body_decompress_zstd_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_decompress_conf_t, zstd_window),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_body_decompress_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_body_decompress_init,         /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_body_decompress_create_conf,  /* create location configuration */
+    ngx_http_body_decompress_merge_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_body_decompress_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_body_decompress_filter_module_ctx, /* module context */
+    ngx_http_body_decompress_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_input_body_filter_pt  ngx_http_next_input_body_filter;
+
+
+/*
+ * the compressed data are passed to the next filters as received,
+ * the decompressed ones replace them in r->request_body
+ */
+
+static ngx_int_t
+ngx_http_body_decompress_filter(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t                         rc;
+    ngx_http_body_decompress_ctx_t   *ctx;
+    ngx_http_body_decompress_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_decompress_filter_module);
+
+    if (!conf->enable) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_decompress_filter_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_body_decompress_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_body_decompress_filter_module);
+
+        rc = ngx_http_body_decompress_start(r, ctx, b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (ctx->pass) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body decompress filter: %uz last:%d",
+                   (size_t) (b->last - b->pos), b->last_buf);
+
+    switch (ctx->type) {
+
+#if (NGX_HAVE_ZSTD)
+    case NGX_HTTP_DECOMPRESS_ZSTD:
+        rc = ngx_http_body_decompress_zstd(r, ctx, b);
+        break;
+#endif
+
+    default: /* NGX_HTTP_DECOMPRESS_GZIP, NGX_HTTP_DECOMPRESS_DEFLATE */
+        rc = ngx_http_body_decompress_inflate(r, ctx, b);
+        break;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (b->last_buf) {
+
+        if (!ctx->done) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent truncated compressed body");
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (ctx->out) {
+            if (ngx_http_request_body_save(r, ctx->out) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ctx->out = NULL;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http body decompressed: %O", ctx->total);
+
+        /* the body stored is not encoded anymore */
+
+        ngx_str_set(&ctx->encoding->value, "identity");
+    }
+
+    return ngx_http_next_input_body_filter(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_body_decompress_start(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b)
+{
+#if (NGX_HAVE_ZSTD)
+    int                               wlog;
+    size_t                            rc;
+#endif
+    ngx_str_t                        *value;
+    ngx_table_elt_t                  *h;
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_core_loc_conf_t         *clcf;
+    ngx_http_body_decompress_conf_t  *conf;
+
+    ctx->pass = 1;
+
+    h = ngx_http_body_decompress_encoding(r);
+    if (h == NULL) {
+        return NGX_OK;
+    }
+
+    value = &h->value;
+
+    if ((value->len == sizeof("gzip") - 1
+         && ngx_strncasecmp(value->data, (u_char *) "gzip", value->len) == 0)
+        || (value->len == sizeof("x-gzip") - 1
+            && ngx_strncasecmp(value->data, (u_char *) "x-gzip", value->len)
+               == 0))
+    {
+        ctx->type = NGX_HTTP_DECOMPRESS_GZIP;
+
+    } else if (value->len == sizeof("deflate") - 1
+               && ngx_strncasecmp(value->data, (u_char *) "deflate",
+                                  value->len) == 0)
+    {
+        ctx->type = NGX_HTTP_DECOMPRESS_DEFLATE;
+
+#if (NGX_HAVE_ZSTD)
+    } else if (value->len == sizeof("zstd") - 1
+               && ngx_strncasecmp(value->data, (u_char *) "zstd",
+                                  value->len) == 0)
+    {
+        ctx->type = NGX_HTTP_DECOMPRESS_ZSTD;
+#endif
+
+    } else {
+        return NGX_OK;
+    }
+
+    if (ngx_http_request_body_replace(r) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_decompress_filter_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ctx->max_size = conf->max_size ? conf->max_size
+                                   : clcf->client_max_body_size;
+    ctx->size = clcf->client_body_buffer_size;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_body_decompress_cleanup;
+    cln->data = ctx;
+
+#if (NGX_HAVE_ZSTD)
+    if (ctx->type == NGX_HTTP_DECOMPRESS_ZSTD) {
+        ctx->dstream = ZSTD_createDStream();
+        if (ctx->dstream == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "ZSTD_createDStream() failed");
+            return NGX_ERROR;
+        }
+
+        /* the window limits the memory a frame may make us allocate */
+
+        for (wlog = 10; ((size_t) 1 << (wlog + 1)) <= conf->zstd_window;
+             wlog++)
+        {
+            /* void */
+        }
+
+        rc = ZSTD_DCtx_setParameter(ctx->dstream, ZSTD_d_windowLogMax, wlog);
+
+        if (ZSTD_isError(rc)) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "ZSTD_DCtx_setParameter(ZSTD_d_windowLogMax, %d) "
+                          "failed: %s", wlog, ZSTD_getErrorName(rc));
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    /* inflateInit2() is called once the first bytes are known */
+
+    ctx->encoding = h;
+    ctx->pass = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_decompress_inflate(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b)
+{
+    int         rc, wbits;
+    size_t      n;
+    ngx_int_t   rv;
+    ngx_uint_t  full;
+
+    if (!ctx->started) {
+
+        if (b->pos == b->last) {
+            return NGX_OK;
+        }
+
+        wbits = MAX_WBITS;
+
+        if (ctx->type == NGX_HTTP_DECOMPRESS_GZIP) {
+            wbits += 16;
+
+        } else if (b->last - b->pos < 2
+                   || (b->pos[0] & 0x0f) != Z_DEFLATED
+                   || ((b->pos[0] << 8) + b->pos[1]) % 31)
+        {
+            /* "deflate" is often sent without the zlib header */
+
+            wbits = -wbits;
+        }
+
+        rc = inflateInit2(&ctx->zstream, wbits);
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "inflateInit2() failed: %d", rc);
+            return NGX_ERROR;
+        }
+
+        ctx->started = 1;
+    }
+
+    ctx->zstream.next_in = b->pos;
+    ctx->zstream.avail_in = b->last - b->pos;
+
+    for ( ;; ) {
+
+        if (ctx->done) {
+
+            if (ctx->zstream.avail_in == 0) {
+                break;
+            }
+
+            /* gzip members may be concatenated */
+
+            if (ctx->type != NGX_HTTP_DECOMPRESS_GZIP) {
+                ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                              "client sent extra data after "
+                              "compressed body");
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            if (inflateReset(&ctx->zstream) != Z_OK) {
+                return NGX_ERROR;
+            }
+
+            ctx->done = 0;
+        }
+
+        if (ngx_http_body_decompress_get_buf(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->zstream.next_out = ctx->out->last;
+        ctx->zstream.avail_out = ctx->out->end - ctx->out->last;
+
+        rc = inflate(&ctx->zstream, Z_NO_FLUSH);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent invalid compressed body: "
+                          "inflate() failed: %d", rc);
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        n = ctx->zstream.next_out - ctx->out->last;
+
+        /* a full buffer means inflate() may have more output pending */
+
+        full = (ctx->zstream.avail_out == 0);
+
+        rv = ngx_http_body_decompress_output(r, ctx, n);
+        if (rv != NGX_OK) {
+            return rv;
+        }
+
+        if (rc == Z_STREAM_END) {
+            ctx->done = 1;
+            continue;
+        }
+
+        if (!full) {
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_ZSTD)
+
+static ngx_int_t
+ngx_http_body_decompress_zstd(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, ngx_buf_t *b)
+{
+    size_t          rc, n, consumed;
+    ngx_int_t       rv;
+    ZSTD_inBuffer   in;
+    ZSTD_outBuffer  out;
+
+    in.src = b->pos;
+    in.size = b->last - b->pos;
+    in.pos = 0;
+
+    /* the empty last part of a chunked body has nothing to decode */
+
+    if (in.size == 0) {
+        return NGX_OK;
+    }
+
+    consumed = 0;
+
+    do {
+        if (ngx_http_body_decompress_get_buf(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        out.dst = ctx->out->last;
+        out.size = ctx->out->end - ctx->out->last;
+        out.pos = 0;
+
+        rc = ZSTD_decompressStream(ctx->dstream, &out, &in);
+
+        if (ZSTD_isError(rc)) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent invalid compressed body: "
+                          "ZSTD_decompressStream() failed: %s",
+                          ZSTD_getErrorName(rc));
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        n = out.pos;
+
+        rv = ngx_http_body_decompress_output(r, ctx, n);
+        if (rv != NGX_OK) {
+            return rv;
+        }
+
+        /*
+         * 0 means a frame is complete, more frames may follow: the body is
+         * incomplete again only once input of the next frame is consumed,
+         * not after a call that only flushed the output
+         */
+
+        if (rc == 0) {
+            ctx->done = 1;
+
+        } else if (consumed < in.pos) {
+            ctx->done = 0;
+        }
+
+        consumed = in.pos;
+
+        /* with the output buffer full more output may be pending */
+
+    } while (in.pos < in.size || out.pos == out.size);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_body_decompress_output(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx, size_t n)
+{
+    ctx->out->last += n;
+    ctx->total += n;
+
+    if (ctx->max_size && ctx->total > ctx->max_size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "client intended to send too large decompressed "
+                      "body: more than %O bytes", ctx->max_size);
+        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (ctx->out->last == ctx->out->end) {
+        if (ngx_http_request_body_save(r, ctx->out) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->out = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_decompress_get_buf(ngx_http_request_t *r,
+    ngx_http_body_decompress_ctx_t *ctx)
+{
+    if (ctx->out) {
+        return NGX_OK;
+    }
+
+    ctx->out = ngx_http_request_body_get_buf(r, ctx->size);
+    if (ctx->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_table_elt_t *
+ngx_http_body_decompress_encoding(ngx_http_request_t *r)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("Content-Encoding") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Content-Encoding",
+                               sizeof("Content-Encoding") - 1)
+               == 0)
+        {
+            return &h[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_body_decompress_cleanup(void *data)
+{
+    ngx_http_body_decompress_ctx_t  *ctx = data;
+
+#if (NGX_HAVE_ZSTD)
+    if (ctx->dstream) {
+        ZSTD_freeDStream(ctx->dstream);
+        return;
+    }
+#endif
+
+    if (ctx->started) {
+        inflateEnd(&ctx->zstream);
+    }
+}
+
+
+static void *
+ngx_http_body_decompress_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_body_decompress_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_body_decompress_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->max_size = NGX_CONF_UNSET;
+    conf->zstd_window = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_body_decompress_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_body_decompress_conf_t *prev = parent;
+    ngx_http_body_decompress_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_off_value(conf->max_size, prev->max_size, 0);
+    ngx_conf_merge_size_value(conf->zstd_window, prev->zstd_window,
+                              8 * 1024 * 1024);
+
+    if (conf->zstd_window < 1024) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"client_body_decompress_zstd_window\" "
+                           "must be at least 1k");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_body_decompress_used(ngx_http_request_t *r)
+{
+    ngx_http_body_decompress_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_decompress_filter_module);
+
+    return conf->enable && ngx_http_body_decompress_encoding(r) != NULL;
+}
+
+
+static ngx_int_t
+ngx_http_body_decompress_init(ngx_conf_t *cf)
+{
+    ngx_http_next_input_body_filter = ngx_http_top_input_body_filter;
+    ngx_http_top_input_body_filter = ngx_http_body_decompress_filter;
+
+    return ngx_http_request_body_filter_used(cf,
+                                             ngx_http_next_input_body_filter,
+                                             ngx_http_body_decompress_used);
+}
@@ -0,0 +1,963 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+
+#if (NGX_OPENSSL)
+#include <openssl/evp.h>
+#endif
+
+/* the crc32 instruction of SSE4.2 computes CRC32C */
+
+#if ((__GNUC__ >= 5 || defined __clang__) && defined __x86_64__)
+#define NGX_HTTP_DIGEST_SSE42  1
+#include <nmmintrin.h>
+#endif
+
+
+#define NGX_HTTP_DIGEST_OFF     0x0002
+#define NGX_HTTP_DIGEST_CRC32C  0x0004
+#define NGX_HTTP_DIGEST_SHA256  0x0008
+#define NGX_HTTP_DIGEST_MD5     0x0010
+
+
+typedef struct {
+    ngx_uint_t                 digests;
+    ngx_flag_t                 verify;
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+#endif
+} ngx_http_body_digest_conf_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct ngx_http_body_digest_part_s  ngx_http_body_digest_part_t;
+
+struct ngx_http_body_digest_part_s {
+    ngx_http_request_body_part_t  *part;
+    u_char                        *pos;
+    u_char                        *last;
+    ngx_http_body_digest_part_t   *next;
+    unsigned                       last_buf:1;
+};
+
+#endif
+
+
+typedef struct {
+    uint32_t                          crc32c;
+    ngx_md5_t                         md5;
+#if (NGX_OPENSSL)
+    EVP_MD_CTX                       *sha256;
+#endif
+
+    u_char                            crc32c_result[4];
+    u_char                            md5_result[16];
+    u_char                            sha256_result[32];
+
+    ngx_uint_t                        digests;
+
+#if (NGX_THREADS)
+    /* the parts digested one at a time, the first one by the task */
+    ngx_thread_task_t                *task;
+    ngx_http_body_digest_part_t      *parts;
+    ngx_http_body_digest_part_t     **last;
+    ngx_http_body_digest_part_t      *free;
+    ngx_int_t                         rc;
+#endif
+
+    unsigned                          done:1;
+} ngx_http_body_digest_ctx_t;
+
+
+static ngx_int_t ngx_http_body_digest_filter(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static ngx_uint_t ngx_http_body_digest_used(ngx_http_request_t *r);
+static ngx_int_t ngx_http_body_digest_update(
+    ngx_http_body_digest_ctx_t *ctx, u_char *p, size_t size, ngx_log_t *log);
+static ngx_int_t ngx_http_body_digest_final(
+    ngx_http_body_digest_ctx_t *ctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_body_digest_thread_filter(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx, ngx_buf_t *b);
+static void ngx_http_body_digest_thread_post(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx);
+static void ngx_http_body_digest_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_body_digest_thread_event_handler(ngx_event_t *ev);
+#endif
+#if (NGX_OPENSSL)
+static void ngx_http_body_digest_cleanup(void *data);
+#endif
+static ngx_int_t ngx_http_body_digest_verify(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx);
+static ngx_int_t ngx_http_body_digest_compare(ngx_http_request_t *r,
+    ngx_str_t *name, ngx_str_t *value, u_char *digest, size_t len);
+static ngx_table_elt_t *ngx_http_body_digest_header(
+    ngx_http_request_t *r, char *name, size_t len);
+
+static uint32_t ngx_http_body_crc32c(uint32_t crc, u_char *p,
+    size_t len);
+#if (NGX_HTTP_DIGEST_SSE42)
+static uint32_t ngx_http_body_crc32c_sse42(uint32_t crc, u_char *p,
+    size_t len);
+#endif
+
+static ngx_int_t ngx_http_body_digest_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_body_digest_add_variables(ngx_conf_t *cf);
+static void *ngx_http_body_digest_create_conf(ngx_conf_t *cf);
+static char *ngx_http_body_digest_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_body_digest_thread_pool(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_body_digest_init(ngx_conf_t *cf);
+
+
+static ngx_conf_bitmask_t  ngx_http_body_digest_mask[] = {
+    { ngx_string("off"), NGX_HTTP_DIGEST_OFF },
+    { ngx_string("crc32c"), NGX_HTTP_DIGEST_CRC32C },
+    { ngx_string("sha256"), NGX_HTTP_DIGEST_SHA256 },
+    { ngx_string("md5"), NGX_HTTP_DIGEST_MD5 },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_http_body_digest_commands[] = {
+
+    { ngx_string("client_body_digest"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_digest_conf_t, digests),
+      &ngx_http_body_digest_mask },
+
+    { ngx_string("client_body_digest_verify"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_digest_conf_t, verify),
+      NULL },
+
+    { ngx_string("client_body_digest_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_body_digest_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_body_digest_filter_module_ctx = {
+    ngx_http_body_digest_add_variables,    /* preconfiguration */
+    ngx_http_body_digest_init,             /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_body_digest_create_conf,      /* create location configuration */
+    ngx_http_body_digest_merge_conf        /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_body_digest_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_body_digest_filter_module_ctx, /* module context */
+    ngx_http_body_digest_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_variable_t  ngx_http_body_digest_vars[] = {
+
+    { ngx_string("request_body_crc32c"), NULL,
+      ngx_http_body_digest_variable, NGX_HTTP_DIGEST_CRC32C,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_sha256"), NULL,
+      ngx_http_body_digest_variable, NGX_HTTP_DIGEST_SHA256,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_md5"), NULL,
+      ngx_http_body_digest_variable, NGX_HTTP_DIGEST_MD5,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+static ngx_http_input_body_filter_pt  ngx_http_next_input_body_filter;
+
+static uint32_t    ngx_http_body_crc32c_table[256];
+#if (NGX_HTTP_DIGEST_SSE42)
+static ngx_uint_t  ngx_http_body_crc32c_hw;
+#endif
+
+
+static ngx_int_t
+ngx_http_body_digest_filter(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+#if (NGX_OPENSSL)
+    ngx_pool_cleanup_t           *cln;
+#endif
+    ngx_http_body_digest_ctx_t   *ctx;
+    ngx_http_body_digest_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_digest_filter_module);
+
+    if (conf->digests & NGX_HTTP_DIGEST_OFF) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_digest_filter_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_body_digest_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->digests = conf->digests;
+        ctx->crc32c = 0xffffffff;
+
+        if (ctx->digests & NGX_HTTP_DIGEST_MD5) {
+            ngx_md5_init(&ctx->md5);
+        }
+
+#if (NGX_OPENSSL)
+        if (ctx->digests & NGX_HTTP_DIGEST_SHA256) {
+            cln = ngx_pool_cleanup_add(r->pool, 0);
+            if (cln == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->sha256 = EVP_MD_CTX_new();
+            if (ctx->sha256 == NULL) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "EVP_MD_CTX_new() failed");
+                return NGX_ERROR;
+            }
+
+            cln->handler = ngx_http_body_digest_cleanup;
+            cln->data = ctx;
+
+            if (EVP_DigestInit_ex(ctx->sha256, EVP_sha256(), NULL) != 1) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "EVP_DigestInit_ex() failed");
+                return NGX_ERROR;
+            }
+        }
+#endif
+
+        ngx_http_set_ctx(r, ctx, ngx_http_body_digest_filter_module);
+    }
+
+    if (ctx->done) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    size = b->last - b->pos;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body digest filter: %uz last:%d",
+                   size, b->last_buf);
+
+#if (NGX_THREADS)
+    if (conf->thread_pool && (size || b->last_buf || ctx->parts)) {
+        return ngx_http_body_digest_thread_filter(r, ctx, b);
+    }
+#endif
+
+    if (ngx_http_body_digest_update(ctx, b->pos, size, r->connection->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (b->last_buf) {
+        if (ngx_http_body_digest_final(ctx) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "EVP_DigestFinal_ex() failed");
+            return NGX_ERROR;
+        }
+
+        if (conf->verify) {
+            rc = ngx_http_body_digest_verify(r, ctx);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+    }
+
+    return ngx_http_next_input_body_filter(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_body_digest_update(ngx_http_body_digest_ctx_t *ctx, u_char *p,
+    size_t size, ngx_log_t *log)
+{
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    if (ctx->digests & NGX_HTTP_DIGEST_CRC32C) {
+        ctx->crc32c = ngx_http_body_crc32c(ctx->crc32c, p, size);
+    }
+
+    if (ctx->digests & NGX_HTTP_DIGEST_MD5) {
+        ngx_md5_update(&ctx->md5, p, size);
+    }
+
+#if (NGX_OPENSSL)
+    if ((ctx->digests & NGX_HTTP_DIGEST_SHA256)
+        && EVP_DigestUpdate(ctx->sha256, p, size) != 1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "EVP_DigestUpdate() failed");
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_digest_final(ngx_http_body_digest_ctx_t *ctx)
+{
+    uint32_t  crc;
+
+    crc = ctx->crc32c ^ 0xffffffff;
+
+    /* big-endian, as in the "Digest: crc32c=" header */
+
+    ctx->crc32c_result[0] = (u_char) (crc >> 24);
+    ctx->crc32c_result[1] = (u_char) (crc >> 16);
+    ctx->crc32c_result[2] = (u_char) (crc >> 8);
+    ctx->crc32c_result[3] = (u_char) crc;
+
+    if (ctx->digests & NGX_HTTP_DIGEST_MD5) {
+        ngx_md5_final(ctx->md5_result, &ctx->md5);
+    }
+
+#if (NGX_OPENSSL)
+    if ((ctx->digests & NGX_HTTP_DIGEST_SHA256)
+        && EVP_DigestFinal_ex(ctx->sha256, ctx->sha256_result, NULL) != 1)
+    {
+        return NGX_ERROR;
+    }
+#endif
+
+    ctx->done = 1;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * the digests are updated in order, so one task digests the parts of
+ * a request at a time and the rest wait for it; the core passes them on
+ * as they are done
+ */
+
+static ngx_int_t
+ngx_http_body_digest_thread_filter(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx, ngx_buf_t *b)
+{
+    ngx_thread_task_t            *task;
+    ngx_http_body_digest_part_t  *p;
+
+    if (ctx->task == NULL) {
+        task = ngx_thread_task_alloc(r->pool, 0);
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->ctx = ctx;
+        task->handler = ngx_http_body_digest_thread_handler;
+        task->event.data = r;
+        task->event.handler = ngx_http_body_digest_thread_event_handler;
+
+        ctx->task = task;
+        ctx->last = &ctx->parts;
+    }
+
+    p = ctx->free;
+
+    if (p) {
+        ctx->free = p->next;
+
+    } else {
+        p = ngx_palloc(r->pool, sizeof(ngx_http_body_digest_part_t));
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    p->part = ngx_http_request_body_filter_async(r, b,
+                                                 ngx_http_next_input_body_filter);
+    if (p->part == NULL) {
+        p->next = ctx->free;
+        ctx->free = p;
+        return NGX_ERROR;
+    }
+
+    p->pos = b->pos;
+    p->last = b->last;
+    p->last_buf = b->last_buf;
+    p->next = NULL;
+
+    *ctx->last = p;
+    ctx->last = &p->next;
+
+    if (ctx->parts == p) {
+        ngx_http_body_digest_thread_post(r, ctx);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_body_digest_thread_post(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx)
+{
+    ngx_http_body_digest_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_digest_filter_module);
+
+    if (ngx_thread_task_post(conf->thread_pool, ctx->task) == NGX_OK) {
+        return;
+    }
+
+    /* the queue of the pool is full, the part is digested here */
+
+    ngx_http_body_digest_thread_handler(ctx, r->connection->log);
+
+    ngx_post_event(&ctx->task->event, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_body_digest_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_body_digest_ctx_t *ctx = data;
+
+    ngx_http_body_digest_part_t  *p;
+
+    p = ctx->parts;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http body digest thread handler: %uz",
+                   (size_t) (p->last - p->pos));
+
+    if (ctx->rc != NGX_OK) {
+        return;
+    }
+
+    if (ngx_http_body_digest_update(ctx, p->pos, p->last - p->pos, log)
+        != NGX_OK)
+    {
+        ctx->rc = NGX_ERROR;
+        return;
+    }
+
+    if (p->last_buf && ngx_http_body_digest_final(ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "EVP_DigestFinal_ex() failed");
+        ctx->rc = NGX_ERROR;
+    }
+}
+
+
+static void
+ngx_http_body_digest_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_body_digest_ctx_t    *ctx;
+    ngx_http_body_digest_part_t   *p;
+    ngx_http_body_digest_conf_t   *conf;
+    ngx_http_request_body_part_t  *part;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_digest_filter_module);
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_digest_filter_module);
+
+    p = ctx->parts;
+
+    ctx->parts = p->next;
+    if (ctx->parts == NULL) {
+        ctx->last = &ctx->parts;
+    }
+
+    part = p->part;
+
+    if (p->last_buf && ctx->rc == NGX_OK && conf->verify) {
+        ctx->rc = ngx_http_body_digest_verify(r, ctx);
+    }
+
+    p->next = ctx->free;
+    ctx->free = p;
+
+    /* the next part is posted first, the request may be done with below */
+
+    if (ctx->parts) {
+        ngx_http_body_digest_thread_post(r, ctx);
+    }
+
+    ngx_http_request_body_filter_done(r, part, ctx->rc);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+#if (NGX_OPENSSL)
+
+static void
+ngx_http_body_digest_cleanup(void *data)
+{
+    ngx_http_body_digest_ctx_t  *ctx = data;
+
+    EVP_MD_CTX_free(ctx->sha256);
+}
+
+#endif
+
+
+/*
+ * "Content-MD5: base64" and "Digest: alg=base64, ..." as in RFC 3230,
+ * the algorithms that were not computed are ignored
+ */
+
+static ngx_int_t
+ngx_http_body_digest_verify(ngx_http_request_t *r,
+    ngx_http_body_digest_ctx_t *ctx)
+{
+    u_char           *p, *last, *eq, *end;
+    ngx_str_t         name, value;
+    ngx_table_elt_t  *h;
+
+    if (ctx->digests & NGX_HTTP_DIGEST_MD5) {
+        h = ngx_http_body_digest_header(r, "Content-MD5",
+                                        sizeof("Content-MD5") - 1);
+
+        if (h) {
+            ngx_str_set(&name, "Content-MD5");
+
+            if (ngx_http_body_digest_compare(r, &name, &h->value,
+                                             ctx->md5_result, 16)
+                != NGX_OK)
+            {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+        }
+    }
+
+    h = ngx_http_body_digest_header(r, "Digest", sizeof("Digest") - 1);
+    if (h == NULL) {
+        return NGX_OK;
+    }
+
+    p = h->value.data;
+    last = p + h->value.len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        end = ngx_strlchr(p, last, ',');
+        if (end == NULL) {
+            end = last;
+        }
+
+        eq = ngx_strlchr(p, end, '=');
+
+        if (eq) {
+            name.data = p;
+            name.len = eq - p;
+
+            value.data = eq + 1;
+            value.len = end - eq - 1;
+
+            while (value.len && value.data[value.len - 1] == ' ') {
+                value.len--;
+            }
+
+            if ((ctx->digests & NGX_HTTP_DIGEST_SHA256)
+                && name.len == sizeof("sha-256") - 1
+                && ngx_strncasecmp(name.data, (u_char *) "sha-256",
+                                   name.len) == 0)
+            {
+                if (ngx_http_body_digest_compare(r, &name, &value,
+                                                 ctx->sha256_result, 32)
+                    != NGX_OK)
+                {
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+
+            } else if ((ctx->digests & NGX_HTTP_DIGEST_MD5)
+                       && name.len == sizeof("md5") - 1
+                       && ngx_strncasecmp(name.data, (u_char *) "md5",
+                                          name.len) == 0)
+            {
+                if (ngx_http_body_digest_compare(r, &name, &value,
+                                                 ctx->md5_result, 16)
+                    != NGX_OK)
+                {
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+
+            } else if ((ctx->digests & NGX_HTTP_DIGEST_CRC32C)
+                       && name.len == sizeof("crc32c") - 1
+                       && ngx_strncasecmp(name.data, (u_char *) "crc32c",
+                                          name.len) == 0)
+            {
+                if (ngx_http_body_digest_compare(r, &name, &value,
+                                                 ctx->crc32c_result, 4)
+                    != NGX_OK)
+                {
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+            }
+        }
+
+        p = end;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_digest_compare(ngx_http_request_t *r, ngx_str_t *name,
+    ngx_str_t *value, u_char *digest, size_t len)
+{
+    u_char     buf[64];
+    ngx_str_t  decoded;
+
+    if (ngx_base64_decoded_length(value->len) <= sizeof(buf)) {
+        decoded.data = buf;
+
+        if (ngx_decode_base64(&decoded, value) == NGX_OK
+            && decoded.len == len
+            && ngx_memcmp(decoded.data, digest, len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent request body with mismatching \"%V\" "
+                  "digest \"%V\"", name, value);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_table_elt_t *
+ngx_http_body_digest_header(ngx_http_request_t *r, char *name,
+    size_t len)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == len
+            && ngx_strncasecmp(h[i].key.data, (u_char *) name, len) == 0)
+        {
+            return &h[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static uint32_t
+ngx_http_body_crc32c(uint32_t crc, u_char *p, size_t len)
+{
+#if (NGX_HTTP_DIGEST_SSE42)
+    if (ngx_http_body_crc32c_hw) {
+        return ngx_http_body_crc32c_sse42(crc, p, len);
+    }
+#endif
+
+    while (len--) {
+        crc = ngx_http_body_crc32c_table[(crc ^ *p++) & 0xff]
+              ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if (NGX_HTTP_DIGEST_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+ngx_http_body_crc32c_sse42(uint32_t crc, u_char *p, size_t len)
+{
+    uint64_t  c;
+
+    c = crc;
+
+    while (len && ((uintptr_t) p & 7)) {
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, *(uint64_t *) p);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+    }
+
+    return (uint32_t) c;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_body_digest_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                      *p, *digest;
+    size_t                       len;
+    ngx_http_body_digest_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_digest_filter_module);
+
+    if (ctx == NULL || !ctx->done || !(ctx->digests & data)) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch (data) {
+
+    case NGX_HTTP_DIGEST_CRC32C:
+        digest = ctx->crc32c_result;
+        len = 4;
+        break;
+
+    case NGX_HTTP_DIGEST_SHA256:
+        digest = ctx->sha256_result;
+        len = 32;
+        break;
+
+    default: /* NGX_HTTP_DIGEST_MD5 */
+        digest = ctx->md5_result;
+        len = 16;
+        break;
+    }
+
+    p = ngx_pnalloc(r->pool, len * 2);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_hex_dump(p, digest, len) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_digest_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_body_digest_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_body_digest_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_body_digest_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_body_digest_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->digests = 0;
+     */
+
+    conf->verify = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
+    return conf;
+}
+
+
+static char *
+ngx_http_body_digest_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_body_digest_conf_t *prev = parent;
+    ngx_http_body_digest_conf_t *conf = child;
+
+    ngx_conf_merge_bitmask_value(conf->digests, prev->digests,
+                                 (NGX_CONF_BITMASK_SET|NGX_HTTP_DIGEST_OFF));
+
+    if (conf->digests & NGX_HTTP_DIGEST_OFF) {
+        conf->digests = NGX_CONF_BITMASK_SET|NGX_HTTP_DIGEST_OFF;
+    }
+
+#if !(NGX_OPENSSL)
+    if (conf->digests & NGX_HTTP_DIGEST_SHA256) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"client_body_digest sha256\" requires OpenSSL");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    ngx_conf_merge_value(conf->verify, prev->verify, 0);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_body_digest_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_body_digest_conf_t *dcf = conf;
+
+    ngx_str_t  *value;
+
+    if (dcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        dcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    dcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (dcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"client_body_digest_thread_pool\" "
+                       "is unsupported on this platform");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+
+static ngx_uint_t
+ngx_http_body_digest_used(ngx_http_request_t *r)
+{
+    ngx_http_body_digest_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_digest_filter_module);
+
+    return !(conf->digests & NGX_HTTP_DIGEST_OFF);
+}
+
+
+static ngx_int_t
+ngx_http_body_digest_init(ngx_conf_t *cf)
+{
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    /* the reflected Castagnoli polynomial */
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+        }
+
+        ngx_http_body_crc32c_table[i] = c;
+    }
+
+#if (NGX_HTTP_DIGEST_SSE42)
+    ngx_http_body_crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+
+    ngx_http_next_input_body_filter = ngx_http_top_input_body_filter;
+    ngx_http_top_input_body_filter = ngx_http_body_digest_filter;
+
+    return ngx_http_request_body_filter_used(cf,
+                                             ngx_http_next_input_body_filter,
+                                             ngx_http_body_digest_used);
+}
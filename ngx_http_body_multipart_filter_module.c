@@ -0,0 +1,1149 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* SSE2 is always there on x86_64, AVX2 is looked for at startup */
+
+#if ((__GNUC__ >= 5 || defined __clang__) && defined __x86_64__)
+#define NGX_HTTP_MULTIPART_SIMD  1
+#include <immintrin.h>
+#endif
+
+
+#define NGX_HTTP_MULTIPART_OFF          0
+#define NGX_HTTP_MULTIPART_ON           1
+#define NGX_HTTP_MULTIPART_KEEP         2
+
+#define NGX_HTTP_MULTIPART_HEADER_SIZE  4096
+
+
+typedef struct {
+    ngx_uint_t                 mode;
+    size_t                     field_size;
+    ngx_uint_t                 max_parts;
+} ngx_http_body_multipart_conf_t;
+
+
+typedef enum {
+    sw_preamble = 0,
+    sw_boundary,
+    sw_boundary_lf,
+    sw_close,
+    sw_headers,
+    sw_data,
+    sw_epilogue
+} ngx_http_body_multipart_state_e;
+
+
+typedef struct {
+    /* CRLF "--" boundary */
+    ngx_str_t                  delim;
+    size_t                     match;
+    ngx_http_body_multipart_state_e  state;
+
+    ngx_buf_t                 *header;
+    ngx_buf_t                 *field;
+    size_t                     field_size;
+    ngx_uint_t                 max_parts;
+
+    ngx_array_t               *parts;
+    ngx_http_body_multipart_part_t  *part;
+
+    unsigned                   pass:1;
+    unsigned                   done:1;
+} ngx_http_body_multipart_ctx_t;
+
+
+static ngx_int_t ngx_http_body_multipart_filter(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static ngx_uint_t ngx_http_body_multipart_used(ngx_http_request_t *r);
+static ngx_int_t ngx_http_body_multipart_start(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx);
+static ngx_int_t ngx_http_body_multipart_boundary(ngx_http_request_t *r,
+    ngx_str_t *boundary);
+static ngx_int_t ngx_http_body_multipart_parse(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx, u_char *p, u_char *last);
+static ngx_int_t ngx_http_body_multipart_headers(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx);
+static ngx_int_t ngx_http_body_multipart_disposition(ngx_http_request_t *r,
+    ngx_http_body_multipart_part_t *part, u_char *p, u_char *last);
+static u_char *ngx_http_body_multipart_param(ngx_http_request_t *r,
+    u_char *p, u_char *last, ngx_str_t *value);
+static void ngx_http_body_multipart_done(ngx_http_body_multipart_ctx_t *ctx);
+static ngx_int_t ngx_http_body_multipart_write(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx, u_char *p, size_t len);
+static ngx_int_t ngx_http_body_multipart_spill(ngx_http_request_t *r,
+    ngx_http_body_multipart_part_t *part, u_char *p, size_t len);
+
+static u_char *ngx_http_body_multipart_find(u_char *p, u_char *last,
+    ngx_str_t *delim);
+static size_t ngx_http_body_multipart_tail(u_char *p, u_char *last,
+    ngx_str_t *delim);
+#if (NGX_HTTP_MULTIPART_SIMD)
+static u_char *ngx_http_body_multipart_find_sse2(u_char **pos, u_char *last,
+    ngx_str_t *delim);
+static u_char *ngx_http_body_multipart_find_avx2(u_char **pos, u_char *last,
+    ngx_str_t *delim);
+#endif
+
+static void *ngx_http_body_multipart_create_conf(ngx_conf_t *cf);
+static char *ngx_http_body_multipart_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_http_body_multipart_init(ngx_conf_t *cf);
+
+
+static ngx_conf_enum_t  ngx_http_body_multipart_modes[] = {
+    { ngx_string("off"), NGX_HTTP_MULTIPART_OFF },
+    { ngx_string("on"), NGX_HTTP_MULTIPART_ON },
+    { ngx_string("keep"), NGX_HTTP_MULTIPART_KEEP },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_http_body_multipart_commands[] = {
+
+    { ngx_string("client_body_multipart"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_multipart_conf_t, mode),
+      &ngx_http_body_multipart_modes },
+
+    { ngx_string("client_body_multipart_field_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_multipart_conf_t, field_size),
+      NULL },
+
+    { ngx_string("client_body_multipart_max_parts"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_multipart_conf_t, max_parts),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_body_multipart_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_body_multipart_init,          /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_body_multipart_create_conf,   /* create location configuration */
+    ngx_http_body_multipart_merge_conf     /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_body_multipart_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_body_multipart_filter_module_ctx, /* module context */
+    ngx_http_body_multipart_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_input_body_filter_pt  ngx_http_next_input_body_filter;
+
+#if (NGX_HTTP_MULTIPART_SIMD)
+static ngx_uint_t  ngx_http_body_multipart_avx2;
+#endif
+
+
+/*
+ * the parts are parsed as the body is received: the form fields are kept
+ * in memory, the files and the larger fields are written to their own
+ * temp files.  With "on" the envelope itself is dropped, with "keep" it
+ * is read into r->request_body as usual
+ */
+
+static ngx_int_t
+ngx_http_body_multipart_filter(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t                        rc;
+    ngx_http_body_multipart_ctx_t   *ctx;
+    ngx_http_body_multipart_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_multipart_filter_module);
+
+    if (conf->mode == NGX_HTTP_MULTIPART_OFF) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_multipart_filter_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_body_multipart_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_body_multipart_filter_module);
+
+        rc = ngx_http_body_multipart_start(r, ctx);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (ctx->pass) {
+        return ngx_http_next_input_body_filter(r, b);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body multipart filter: %uz last:%d",
+                   (size_t) (b->last - b->pos), b->last_buf);
+
+    rc = ngx_http_body_multipart_parse(r, ctx, b->pos, b->last);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (b->last_buf) {
+
+        if (ctx->state != sw_epilogue) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent truncated multipart body");
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http body multipart parts: %ui", ctx->parts->nelts);
+
+        ctx->done = 1;
+    }
+
+    return ngx_http_next_input_body_filter(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_start(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx)
+{
+    u_char                          *p;
+    ngx_str_t                        boundary;
+    ngx_http_body_multipart_conf_t  *conf;
+
+    ctx->pass = 1;
+
+    if (ngx_http_body_multipart_boundary(r, &boundary) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_multipart_filter_module);
+
+    ctx->delim.len = sizeof(CRLF "--") - 1 + boundary.len;
+    ctx->delim.data = ngx_pnalloc(r->pool, ctx->delim.len);
+    if (ctx->delim.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(ctx->delim.data, CRLF "--", sizeof(CRLF "--") - 1);
+    ngx_memcpy(p, boundary.data, boundary.len);
+
+    ctx->header = ngx_create_temp_buf(r->pool, NGX_HTTP_MULTIPART_HEADER_SIZE);
+    if (ctx->header == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->parts = ngx_array_create(r->pool, 4,
+                                  sizeof(ngx_http_body_multipart_part_t));
+    if (ctx->parts == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->field_size = conf->field_size;
+    ctx->max_parts = conf->max_parts;
+
+    /* the first boundary may be at the very start, as if after CRLF */
+
+    ctx->state = sw_preamble;
+    ctx->match = sizeof(CRLF) - 1;
+
+    if (conf->mode == NGX_HTTP_MULTIPART_ON) {
+        (void) ngx_http_request_body_replace(r);
+    }
+
+    ctx->pass = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_boundary(ngx_http_request_t *r, ngx_str_t *boundary)
+{
+    u_char  *p, *last, *start;
+
+    if (r->headers_in.content_type == NULL) {
+        return NGX_DECLINED;
+    }
+
+    p = r->headers_in.content_type->value.data;
+    last = p + r->headers_in.content_type->value.len;
+
+    if (last - p < (ssize_t) sizeof("multipart/form-data") - 1
+        || ngx_strncasecmp(p, (u_char *) "multipart/form-data",
+                           sizeof("multipart/form-data") - 1)
+           != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    p += sizeof("multipart/form-data") - 1;
+
+    for ( ;; ) {
+        p = ngx_strlchr(p, last, ';');
+        if (p == NULL) {
+            return NGX_DECLINED;
+        }
+
+        do {
+            p++;
+        } while (p < last && (*p == ' ' || *p == '\t'));
+
+        if (last - p > (ssize_t) sizeof("boundary=") - 1
+            && ngx_strncasecmp(p, (u_char *) "boundary=",
+                               sizeof("boundary=") - 1)
+               == 0)
+        {
+            break;
+        }
+    }
+
+    p += sizeof("boundary=") - 1;
+
+    if (*p == '"') {
+        start = ++p;
+        p = ngx_strlchr(p, last, '"');
+        if (p == NULL) {
+            goto invalid;
+        }
+
+    } else {
+        for (start = p; p < last && *p != ';' && *p != ' '; p++) {
+            /* void */
+        }
+    }
+
+    boundary->data = start;
+    boundary->len = p - start;
+
+    /* RFC 2046, the delimiter must not contain CR and LF */
+
+    if (boundary->len == 0 || boundary->len > 70) {
+        goto invalid;
+    }
+
+    for (p = start; p < start + boundary->len; p++) {
+        if (*p < 0x20 || *p >= 0x7f) {
+            goto invalid;
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent invalid multipart boundary in \"%V\"",
+                  &r->headers_in.content_type->value);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_parse(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char     ch, *q, *h;
+    size_t     n;
+    ngx_int_t  rc;
+
+    while (p < last) {
+
+        switch (ctx->state) {
+
+        case sw_preamble:
+        case sw_data:
+
+            if (ctx->match) {
+
+                /* the delimiter started at the end of the previous buffer */
+
+                n = ngx_min((size_t) (last - p), ctx->delim.len - ctx->match);
+
+                if (ngx_memcmp(p, ctx->delim.data + ctx->match, n) == 0) {
+                    ctx->match += n;
+                    p += n;
+
+                    if (ctx->match < ctx->delim.len) {
+                        break;
+                    }
+
+                    ctx->match = 0;
+
+                    if (ctx->state == sw_data) {
+                        ngx_http_body_multipart_done(ctx);
+                    }
+
+                    ctx->state = sw_boundary;
+                    break;
+                }
+
+                /* CR is only the first byte of the delimiter, so it was data */
+
+                if (ctx->state == sw_data) {
+                    rc = ngx_http_body_multipart_write(r, ctx, ctx->delim.data,
+                                                       ctx->match);
+                    if (rc != NGX_OK) {
+                        return rc;
+                    }
+                }
+
+                ctx->match = 0;
+            }
+
+            q = ngx_http_body_multipart_find(p, last, &ctx->delim);
+
+            if (q) {
+                if (ctx->state == sw_data) {
+                    rc = ngx_http_body_multipart_write(r, ctx, p, q - p);
+                    if (rc != NGX_OK) {
+                        return rc;
+                    }
+
+                    ngx_http_body_multipart_done(ctx);
+                }
+
+                p = q + ctx->delim.len;
+                ctx->state = sw_boundary;
+                break;
+            }
+
+            n = ngx_http_body_multipart_tail(p, last, &ctx->delim);
+
+            if (ctx->state == sw_data) {
+                rc = ngx_http_body_multipart_write(r, ctx, p, last - n - p);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
+            ctx->match = n;
+            p = last;
+            break;
+
+        case sw_boundary:
+            ch = *p++;
+
+            if (ch == '-') {
+                ctx->state = sw_close;
+                break;
+            }
+
+            if (ch == CR) {
+                ctx->state = sw_boundary_lf;
+                break;
+            }
+
+            /* the transport padding */
+
+            if (ch == ' ' || ch == '\t') {
+                break;
+            }
+
+            goto invalid;
+
+        case sw_boundary_lf:
+            if (*p++ != LF) {
+                goto invalid;
+            }
+
+            ctx->header->last = ctx->header->pos;
+            ctx->state = sw_headers;
+            break;
+
+        case sw_close:
+            if (*p++ != '-') {
+                goto invalid;
+            }
+
+            ctx->state = sw_epilogue;
+            break;
+
+        case sw_headers:
+            h = ctx->header->last;
+
+            while (p < last) {
+
+                if (h == ctx->header->end) {
+                    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                                  "client sent too large multipart "
+                                  "part header");
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+
+                *h++ = *p++;
+
+                if (h[-1] != LF) {
+                    continue;
+                }
+
+                /* an empty line ends the headers */
+
+                n = h - ctx->header->pos;
+
+                if ((n == 2 && h[-2] == CR)
+                    || (n >= 4 && h[-2] == CR && h[-3] == LF && h[-4] == CR))
+                {
+                    ctx->header->last = h;
+
+                    rc = ngx_http_body_multipart_headers(r, ctx);
+                    if (rc != NGX_OK) {
+                        return rc;
+                    }
+
+                    ctx->state = sw_data;
+                    break;
+                }
+            }
+
+            ctx->header->last = h;
+            break;
+
+        case sw_epilogue:
+
+            /* the epilogue is ignored */
+
+            return NGX_OK;
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent invalid multipart boundary line");
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_headers(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx)
+{
+    u_char                          *p, *last, *eol, *colon, *v;
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_http_body_multipart_part_t  *part;
+
+    if (ctx->parts->nelts == ctx->max_parts) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "client sent too many multipart parts");
+        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    part = ngx_array_push(ctx->parts);
+    if (part == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(part, sizeof(ngx_http_body_multipart_part_t));
+
+    ctx->part = part;
+    ctx->field = NULL;
+
+    p = ctx->header->pos;
+    last = ctx->header->last;
+
+    while (p < last) {
+        eol = ngx_strlchr(p, last, LF);
+        if (eol == NULL) {
+            eol = last;
+        }
+
+        len = eol - p;
+
+        if (len && p[len - 1] == CR) {
+            len--;
+        }
+
+        colon = ngx_strlchr(p, p + len, ':');
+
+        if (colon) {
+            for (v = colon + 1; v < p + len && (*v == ' ' || *v == '\t'); v++)
+            {
+                /* void */
+            }
+
+            if (colon - p == sizeof("Content-Disposition") - 1
+                && ngx_strncasecmp(p, (u_char *) "Content-Disposition",
+                                   sizeof("Content-Disposition") - 1)
+                   == 0)
+            {
+                rc = ngx_http_body_multipart_disposition(r, part, v, p + len);
+
+                if (rc == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+
+                if (rc != NGX_OK) {
+                    goto invalid;
+                }
+
+            } else if (colon - p == sizeof("Content-Type") - 1
+                       && ngx_strncasecmp(p, (u_char *) "Content-Type",
+                                          sizeof("Content-Type") - 1)
+                          == 0)
+            {
+                part->content_type.len = p + len - v;
+                part->content_type.data = ngx_pnalloc(r->pool,
+                                                      part->content_type.len);
+                if (part->content_type.data == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ngx_memcpy(part->content_type.data, v,
+                           part->content_type.len);
+            }
+        }
+
+        p = eol + 1;
+    }
+
+    if (part->name.data == NULL) {
+        goto invalid;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body multipart part \"%V\" file:\"%V\" type:\"%V\"",
+                   &part->name, &part->filename, &part->content_type);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent multipart part without form-data "
+                  "Content-Disposition");
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_disposition(ngx_http_request_t *r,
+    ngx_http_body_multipart_part_t *part, u_char *p, u_char *last)
+{
+    u_char     *name;
+    size_t      len;
+    ngx_str_t   value;
+
+    if (last - p < (ssize_t) sizeof("form-data") - 1
+        || ngx_strncasecmp(p, (u_char *) "form-data", sizeof("form-data") - 1)
+           != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    p += sizeof("form-data") - 1;
+
+    while (p < last) {
+
+        if (*p == ';' || *p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+
+        name = p;
+
+        while (p < last && *p != '=' && *p != ';') {
+            p++;
+        }
+
+        if (p == last || *p == ';') {
+            continue;
+        }
+
+        len = p - name;
+
+        p = ngx_http_body_multipart_param(r, p + 1, last, &value);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* "filename*" of RFC 5987 is left to the application */
+
+        if (len == sizeof("name") - 1
+            && ngx_strncasecmp(name, (u_char *) "name", len) == 0)
+        {
+            part->name = value;
+
+        } else if (len == sizeof("filename") - 1
+                   && ngx_strncasecmp(name, (u_char *) "filename", len) == 0)
+        {
+            part->filename = value;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_body_multipart_param(ngx_http_request_t *r, u_char *p,
+    u_char *last, ngx_str_t *value)
+{
+    u_char  *start, *d;
+
+    if (p < last && *p == '"') {
+        start = ++p;
+
+        while (p < last && *p != '"') {
+            if (*p == '\\' && p + 1 < last) {
+                p++;
+            }
+
+            p++;
+        }
+
+        /* an empty value is still there, a file part may have no name */
+
+        value->data = ngx_pnalloc(r->pool, p - start + 1);
+        if (value->data == NULL) {
+            return NULL;
+        }
+
+        for (d = value->data; start < p; start++) {
+            if (*start == '\\' && start + 1 < p) {
+                start++;
+            }
+
+            *d++ = *start;
+        }
+
+        value->len = d - value->data;
+
+        return (p < last) ? p + 1 : p;
+    }
+
+    for (start = p; p < last && *p != ';' && *p != ' '; p++) {
+        /* void */
+    }
+
+    value->len = p - start;
+    value->data = ngx_pnalloc(r->pool, value->len + 1);
+    if (value->data == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(value->data, start, value->len);
+
+    return p;
+}
+
+
+static void
+ngx_http_body_multipart_done(ngx_http_body_multipart_ctx_t *ctx)
+{
+    ngx_http_body_multipart_part_t  *part;
+
+    part = ctx->part;
+
+    if (ctx->field) {
+        part->value.data = ctx->field->pos;
+        part->value.len = ctx->field->last - ctx->field->pos;
+        ctx->field = NULL;
+    }
+
+    ctx->part = NULL;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_write(ngx_http_request_t *r,
+    ngx_http_body_multipart_ctx_t *ctx, u_char *p, size_t len)
+{
+    size_t                           size;
+    ngx_buf_t                       *b;
+    ngx_http_body_multipart_part_t  *part;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    part = ctx->part;
+    part->size += len;
+
+    if (part->file || part->filename.data) {
+        return ngx_http_body_multipart_spill(r, part, p, len);
+    }
+
+    /* a form field is kept in memory up to the field size */
+
+    b = ctx->field;
+    size = b ? (size_t) (b->last - b->pos) : 0;
+
+    if (size + len > ctx->field_size) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http body multipart field \"%V\" spilled: %O",
+                       &part->name, part->size);
+
+        if (size
+            && ngx_http_body_multipart_spill(r, part, b->pos, size) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->field = NULL;
+
+        return ngx_http_body_multipart_spill(r, part, p, len);
+    }
+
+    if (b == NULL || (size_t) (b->end - b->last) < len) {
+
+        /* the buffer is grown twice, the old one stays in the pool */
+
+        b = ngx_create_temp_buf(r->pool,
+                                ngx_min(ngx_max(2 * size + len, 256),
+                                        ctx->field_size));
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (size) {
+            b->last = ngx_cpymem(b->last, ctx->field->pos, size);
+        }
+
+        ctx->field = b;
+    }
+
+    b->last = ngx_cpymem(b->last, p, len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_spill(ngx_http_request_t *r,
+    ngx_http_body_multipart_part_t *part, u_char *p, size_t len)
+{
+    ssize_t                    n;
+    ngx_buf_t                  b;
+    ngx_chain_t                cl;
+    ngx_temp_file_t           *tf;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    tf = part->file;
+
+    if (tf == NULL) {
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL) {
+            return NGX_ERROR;
+        }
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = clcf->client_body_temp_path;
+        tf->pool = r->pool;
+        tf->warn = "a multipart body part is buffered to a temporary file";
+        tf->log_level = r->request_body_file_log_level;
+        tf->persistent = r->request_body_in_persistent_file;
+        tf->clean = r->request_body_in_clean_file;
+
+        if (r->request_body_file_group_access) {
+            tf->access = 0660;
+        }
+
+        part->file = tf;
+    }
+
+    /* the received data are written as is, without a copy */
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.memory = 1;
+    b.start = p;
+    b.pos = p;
+    b.last = p + len;
+    b.end = p + len;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    n = ngx_write_chain_to_temp_file(tf, &cl);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    tf->offset += n;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the candidates are the positions with CR and with the last byte of the
+ * delimiter where it would end, only they are compared as a whole
+ */
+
+static u_char *
+ngx_http_body_multipart_find(u_char *p, u_char *last, ngx_str_t *delim)
+{
+    u_char  *d, c;
+    size_t   n;
+
+    n = delim->len;
+    d = delim->data;
+
+#if (NGX_HTTP_MULTIPART_SIMD)
+    {
+    u_char  *q;
+
+    if (ngx_http_body_multipart_avx2) {
+        q = ngx_http_body_multipart_find_avx2(&p, last, delim);
+
+    } else {
+        q = ngx_http_body_multipart_find_sse2(&p, last, delim);
+    }
+
+    if (q) {
+        return q;
+    }
+    }
+#endif
+
+    c = d[n - 1];
+
+    for ( /* void */ ; p + n <= last; p++) {
+        if (*p == CR && p[n - 1] == c && ngx_memcmp(p, d, n) == 0) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+static size_t
+ngx_http_body_multipart_tail(u_char *p, u_char *last, ngx_str_t *delim)
+{
+    size_t  n;
+
+    /* the longest end of the buffer the delimiter may start with */
+
+    if (last - p >= (ssize_t) delim->len) {
+        p = last - (delim->len - 1);
+    }
+
+    for ( /* void */ ; p < last; p++) {
+        n = last - p;
+
+        if (*p == CR && ngx_memcmp(p, delim->data, n) == 0) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+
+#if (NGX_HTTP_MULTIPART_SIMD)
+
+static u_char *
+ngx_http_body_multipart_find_sse2(u_char **pos, u_char *last,
+    ngx_str_t *delim)
+{
+    u_char   *p, *d;
+    size_t    n;
+    unsigned  mask, i;
+    __m128i   cr, c, a, b;
+
+    p = *pos;
+    d = delim->data;
+    n = delim->len;
+
+    cr = _mm_set1_epi8(CR);
+    c = _mm_set1_epi8((char) d[n - 1]);
+
+    while (p + n - 1 + 16 <= last) {
+        a = _mm_loadu_si128((__m128i *) p);
+        b = _mm_loadu_si128((__m128i *) (p + n - 1));
+
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, cr),
+                                               _mm_cmpeq_epi8(b, c)));
+
+        while (mask) {
+            i = __builtin_ctz(mask);
+
+            if (ngx_memcmp(p + i + 1, d + 1, n - 2) == 0) {
+                return p + i;
+            }
+
+            mask &= mask - 1;
+        }
+
+        p += 16;
+    }
+
+    *pos = p;
+
+    return NULL;
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_body_multipart_find_avx2(u_char **pos, u_char *last,
+    ngx_str_t *delim)
+{
+    u_char   *p, *d;
+    size_t    n;
+    unsigned  mask, i;
+    __m256i   cr, c, a, b;
+
+    p = *pos;
+    d = delim->data;
+    n = delim->len;
+
+    cr = _mm256_set1_epi8(CR);
+    c = _mm256_set1_epi8((char) d[n - 1]);
+
+    while (p + n - 1 + 32 <= last) {
+        a = _mm256_loadu_si256((__m256i *) p);
+        b = _mm256_loadu_si256((__m256i *) (p + n - 1));
+
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                                        _mm256_cmpeq_epi8(a, cr),
+                                        _mm256_cmpeq_epi8(b, c)));
+
+        while (mask) {
+            i = __builtin_ctz(mask);
+
+            if (ngx_memcmp(p + i + 1, d + 1, n - 2) == 0) {
+                return p + i;
+            }
+
+            mask &= mask - 1;
+        }
+
+        p += 32;
+    }
+
+    *pos = p;
+
+    return NULL;
+}
+
+#endif
+
+
+ngx_array_t *
+ngx_http_body_multipart_parts(ngx_http_request_t *r)
+{
+    ngx_http_body_multipart_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_multipart_filter_module);
+
+    if (ctx == NULL || !ctx->done) {
+        return NULL;
+    }
+
+    return ctx->parts;
+}
+
+
+static void *
+ngx_http_body_multipart_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_body_multipart_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_body_multipart_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->mode = NGX_CONF_UNSET_UINT;
+    conf->field_size = NGX_CONF_UNSET_SIZE;
+    conf->max_parts = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_body_multipart_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_body_multipart_conf_t *prev = parent;
+    ngx_http_body_multipart_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->mode, prev->mode, NGX_HTTP_MULTIPART_OFF);
+    ngx_conf_merge_size_value(conf->field_size, prev->field_size, 16384);
+    ngx_conf_merge_uint_value(conf->max_parts, prev->max_parts, 128);
+
+    if (conf->max_parts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"client_body_multipart_max_parts\" "
+                           "must not be zero");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_body_multipart_used(ngx_http_request_t *r)
+{
+    ngx_str_t                        boundary;
+    ngx_http_body_multipart_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_body_multipart_filter_module);
+
+    return conf->mode != NGX_HTTP_MULTIPART_OFF
+           && ngx_http_body_multipart_boundary(r, &boundary) == NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_multipart_init(ngx_conf_t *cf)
+{
+#if (NGX_HTTP_MULTIPART_SIMD)
+    ngx_http_body_multipart_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    ngx_http_next_input_body_filter = ngx_http_top_input_body_filter;
+    ngx_http_top_input_body_filter = ngx_http_body_multipart_filter;
+
+    return ngx_http_request_body_filter_used(cf,
+                                             ngx_http_next_input_body_filter,
+                                             ngx_http_body_multipart_used);
+}
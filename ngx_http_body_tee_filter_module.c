@@ -0,0 +1,761 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_http_complex_value_t  *file;
+    size_t                     log_size;
+} ngx_http_body_tee_conf_t;
+
+
+typedef struct {
+    ngx_array_t                sinks;
+    ngx_uint_t                 blocked;
+    unsigned                   started:1;
+} ngx_http_body_tee_ctx_t;
+
+
+static ngx_int_t ngx_http_body_tee_filter(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static ngx_uint_t ngx_http_body_tee_used(ngx_http_request_t *r);
+static ngx_http_body_tee_ctx_t *ngx_http_body_tee_create(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_body_tee_start(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx);
+static ngx_int_t ngx_http_body_tee_push(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_sink_t *sink,
+    ngx_buf_t *in);
+static ngx_int_t ngx_http_body_tee_call(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_sink_t *sink,
+    ngx_buf_t *b);
+static ngx_int_t ngx_http_body_tee_queue(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_sink_t *sink,
+    ngx_buf_t *b);
+static void ngx_http_body_tee_detach(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_sink_t *sink);
+static void ngx_http_body_tee_unblock(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_sink_t *sink);
+
+static ngx_int_t ngx_http_body_tee_file_open(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_conf_t *conf);
+static ngx_int_t ngx_http_body_tee_file_handler(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b);
+static ngx_int_t ngx_http_body_tee_log_handler(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b);
+
+static void *ngx_http_body_tee_create_conf(ngx_conf_t *cf);
+static char *ngx_http_body_tee_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_http_body_tee_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_body_tee_commands[] = {
+
+    { ngx_string("client_body_tee_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_tee_conf_t, file),
+      NULL },
+
+    { ngx_string("client_body_tee_log"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_body_tee_conf_t, log_size),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_body_tee_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_body_tee_init,                /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_body_tee_create_conf,         /* create location configuration */
+    ngx_http_body_tee_merge_conf           /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_body_tee_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_body_tee_filter_module_ctx,  /* module context */
+    ngx_http_body_tee_commands,            /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_input_body_filter_pt  ngx_http_next_input_body_filter;
+
+
+/*
+ * every part of the body received is given to each sink in turn, what
+ * a busy sink leaves is copied to its queue, and only the sinks that
+ * block stop reading from the client when their queue is full
+ */
+
+static ngx_int_t
+ngx_http_body_tee_filter(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  i;
+    ngx_http_body_tee_ctx_t    *ctx;
+    ngx_http_body_tee_conf_t   *conf;
+    ngx_http_body_tee_sink_t  **sinks;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_tee_filter_module);
+
+    if (ctx == NULL) {
+        conf = ngx_http_get_module_loc_conf(r, ngx_http_body_tee_filter_module);
+
+        if (conf->file == NULL && conf->log_size == 0) {
+            return ngx_http_next_input_body_filter(r, b);
+        }
+
+        ctx = ngx_http_body_tee_create(r);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!ctx->started) {
+        if (ngx_http_body_tee_start(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body tee filter: %uz last:%d sinks:%ui",
+                   (size_t) (b->last - b->pos), b->last_buf,
+                   ctx->sinks.nelts);
+
+    sinks = ctx->sinks.elts;
+
+    for (i = 0; i < ctx->sinks.nelts; i++) {
+        rc = ngx_http_body_tee_push(r, ctx, sinks[i], b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return ngx_http_next_input_body_filter(r, b);
+}
+
+
+static ngx_http_body_tee_ctx_t *
+ngx_http_body_tee_create(ngx_http_request_t *r)
+{
+    ngx_http_body_tee_ctx_t  *ctx;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_body_tee_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&ctx->sinks, r->pool, 4,
+                       sizeof(ngx_http_body_tee_sink_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_body_tee_filter_module);
+
+    return ctx;
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_start(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx)
+{
+    ngx_buf_t                 *b;
+    ngx_http_body_tee_conf_t  *conf;
+    ngx_http_body_tee_sink_t  *sink;
+
+    ctx->started = 1;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_tee_filter_module);
+
+    if (conf->file) {
+        if (ngx_http_body_tee_file_open(r, ctx, conf) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (conf->log_size) {
+        b = ngx_create_temp_buf(r->pool, conf->log_size);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        sink = ngx_http_body_tee_add(r);
+        if (sink == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_str_set(&sink->name, "log");
+        sink->handler = ngx_http_body_tee_log_handler;
+        sink->data = b;
+        sink->policy = NGX_HTTP_BODY_TEE_DETACH;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_push(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *in)
+{
+    ngx_int_t  rc;
+    ngx_buf_t  b;
+
+    if (sink->done) {
+        return NGX_OK;
+    }
+
+    if (sink->detached) {
+        sink->dropped += in->last - in->pos;
+        return NGX_OK;
+    }
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+    b.memory = 1;
+    b.start = in->pos;
+    b.pos = in->pos;
+    b.last = in->last;
+    b.end = in->last;
+    b.last_buf = in->last_buf;
+
+    if (sink->queue == NULL) {
+
+        /* the sink is given the received data directly while it keeps up */
+
+        rc = ngx_http_body_tee_call(r, ctx, sink, &b);
+        if (rc != NGX_AGAIN) {
+            return rc;
+        }
+    }
+
+    return ngx_http_body_tee_queue(r, ctx, sink, &b);
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_call(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b)
+{
+    u_char     *pos;
+    ngx_int_t   rc;
+
+    pos = b->pos;
+
+    rc = sink->handler(r, sink, b);
+
+    if (rc == NGX_OK) {
+        b->pos = b->last;
+    }
+
+    sink->sent += b->pos - pos;
+
+    if (rc == NGX_OK) {
+        if (b->last_buf) {
+            sink->done = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "body tee \"%V\" failed after %O bytes",
+                  &sink->name, sink->sent);
+
+    if (sink->policy == NGX_HTTP_BODY_TEE_BLOCK) {
+        return NGX_ERROR;
+    }
+
+    /* a sink that may lose data does not fail the request */
+
+    ngx_http_body_tee_detach(r, ctx, sink);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_queue(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b)
+{
+    size_t                     size, n;
+    ngx_buf_t                 *tail;
+    ngx_chain_t               *cl;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    size = b->last - b->pos;
+
+    if (sink->queued + size > sink->max_size) {
+
+        switch (sink->policy) {
+
+        case NGX_HTTP_BODY_TEE_DROP:
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http body tee \"%V\" drops %uz",
+                           &sink->name, size);
+
+            sink->dropped += size;
+
+            if (!b->last_buf) {
+                return NGX_OK;
+            }
+
+            /* the end of the body is still delivered */
+
+            size = 0;
+            break;
+
+        case NGX_HTTP_BODY_TEE_DETACH:
+
+            sink->dropped += size;
+            ngx_http_body_tee_detach(r, ctx, sink);
+
+            return NGX_OK;
+
+        default: /* NGX_HTTP_BODY_TEE_BLOCK */
+
+            if (!sink->blocking) {
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http body tee \"%V\" blocks at %uz",
+                               &sink->name, sink->queued + size);
+
+                sink->blocking = 1;
+
+                if (ctx->blocked++ == 0) {
+                    ngx_http_request_body_block(r);
+                }
+            }
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    tail = sink->queue ? sink->tail->buf : NULL;
+
+    for ( ;; ) {
+
+        if (tail && tail->last < tail->end) {
+            n = ngx_min(size, (size_t) (tail->end - tail->last));
+
+            tail->last = ngx_cpymem(tail->last, b->pos, n);
+            b->pos += n;
+            size -= n;
+            sink->queued += n;
+        }
+
+        if (size == 0 && (tail || !b->last_buf)) {
+            break;
+        }
+
+        cl = sink->free;
+
+        if (cl && (size_t) (cl->buf->end - cl->buf->start) >= size) {
+            sink->free = cl->next;
+
+        } else {
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = ngx_create_temp_buf(r->pool,
+                                       ngx_max(size,
+                                               clcf->client_body_buffer_size));
+            if (cl->buf == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        cl->next = NULL;
+
+        if (sink->queue) {
+            sink->tail->next = cl;
+
+        } else {
+            sink->queue = cl;
+        }
+
+        sink->tail = cl;
+        tail = cl->buf;
+    }
+
+    if (b->last_buf) {
+        tail->last_buf = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_body_tee_detach(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx,
+    ngx_http_body_tee_sink_t *sink)
+{
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "body tee \"%V\" detached after %O bytes",
+                  &sink->name, sink->sent);
+
+    sink->dropped += sink->queued;
+    sink->queued = 0;
+    sink->queue = NULL;
+    sink->detached = 1;
+
+    if (sink->blocking) {
+        ngx_http_body_tee_unblock(r, ctx, sink);
+    }
+
+    /* the sink learns that the rest of the body will not come */
+
+    (void) sink->handler(r, sink, NULL);
+}
+
+
+static void
+ngx_http_body_tee_unblock(ngx_http_request_t *r, ngx_http_body_tee_ctx_t *ctx,
+    ngx_http_body_tee_sink_t *sink)
+{
+    sink->blocking = 0;
+
+    if (--ctx->blocked == 0) {
+        ngx_http_request_body_unblock(r);
+    }
+}
+
+
+ngx_http_body_tee_sink_t *
+ngx_http_body_tee_add(ngx_http_request_t *r)
+{
+    ngx_http_body_tee_ctx_t    *ctx;
+    ngx_http_body_tee_sink_t   *sink, **p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_tee_filter_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_http_body_tee_create(r);
+        if (ctx == NULL) {
+            return NULL;
+        }
+    }
+
+    sink = ngx_pcalloc(r->pool, sizeof(ngx_http_body_tee_sink_t));
+    if (sink == NULL) {
+        return NULL;
+    }
+
+    p = ngx_array_push(&ctx->sinks);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    *p = sink;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     sink->max_size = 0;
+     *     sink->policy = NGX_HTTP_BODY_TEE_BLOCK;
+     *     sink->queue = NULL;
+     */
+
+    return sink;
+}
+
+
+void
+ngx_http_body_tee_drained(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink)
+{
+    off_t                     sent;
+    ngx_int_t                 rc;
+    ngx_chain_t              *cl;
+    ngx_http_body_tee_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_body_tee_filter_module);
+
+    if (ctx == NULL || sink->detached) {
+        return;
+    }
+
+    while (sink->queue) {
+        cl = sink->queue;
+
+        sent = sink->sent;
+
+        rc = ngx_http_body_tee_call(r, ctx, sink, cl->buf);
+
+        sink->queued -= (size_t) (sink->sent - sent);
+
+        if (rc == NGX_AGAIN || sink->detached) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        sink->queue = cl->next;
+
+        cl->buf->pos = cl->buf->start;
+        cl->buf->last = cl->buf->start;
+        cl->buf->last_buf = 0;
+
+        cl->next = sink->free;
+        sink->free = cl;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http body tee \"%V\" drained, queued:%uz sent:%O",
+                   &sink->name, sink->queued, sink->sent);
+
+    /* reading is continued once half of the queue is drained */
+
+    if (sink->blocking && sink->queued <= sink->max_size / 2) {
+        ngx_http_body_tee_unblock(r, ctx, sink);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_file_open(ngx_http_request_t *r,
+    ngx_http_body_tee_ctx_t *ctx, ngx_http_body_tee_conf_t *conf)
+{
+    ngx_str_t                  name;
+    ngx_file_t                *file;
+    ngx_pool_cleanup_t        *cln;
+    ngx_pool_cleanup_file_t   *clnf;
+    ngx_http_body_tee_sink_t  *sink;
+
+    if (ngx_http_complex_value(r, conf->file, &name) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (name.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (file == NULL) {
+        return NGX_ERROR;
+    }
+
+    file->name.len = name.len;
+    file->name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (file->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(file->name.data, name.data, name.len + 1);
+
+    file->log = r->connection->log;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    file->fd = ngx_open_file(file->name.data, NGX_FILE_WRONLY,
+                             NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file->fd == NGX_INVALID_FILE) {
+
+        /* the body is still read without the copy */
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file->name.data);
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = file->fd;
+    clnf->name = file->name.data;
+    clnf->log = r->pool->log;
+
+    sink = ngx_http_body_tee_add(r);
+    if (sink == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&sink->name, "file");
+    sink->handler = ngx_http_body_tee_file_handler;
+    sink->data = file;
+    sink->policy = NGX_HTTP_BODY_TEE_DETACH;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_file_handler(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b)
+{
+    ngx_file_t  *file;
+
+    file = sink->data;
+
+    if (b == NULL || b->pos == b->last) {
+        return NGX_OK;
+    }
+
+    if (ngx_write_file(file, b->pos, b->last - b->pos, file->offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the start of the body is logged as "\xXX" escaped text once it is read */
+
+static ngx_int_t
+ngx_http_body_tee_log_handler(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b)
+{
+    u_char      *p, *s, *dst;
+    size_t       n;
+    ngx_buf_t   *log;
+    ngx_uint_t   truncated;
+
+    static u_char  hex[] = "0123456789ABCDEF";
+
+    log = sink->data;
+
+    if (b == NULL) {
+        return NGX_OK;
+    }
+
+    n = ngx_min((size_t) (b->last - b->pos), (size_t) (log->end - log->last));
+    log->last = ngx_cpymem(log->last, b->pos, n);
+
+    if (!b->last_buf) {
+        return NGX_OK;
+    }
+
+    dst = ngx_pnalloc(r->pool, 4 * (log->last - log->pos));
+    if (dst == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = dst;
+
+    for (s = log->pos; s < log->last; s++) {
+        if (*s >= 0x20 && *s < 0x7f && *s != '"' && *s != '\\') {
+            *p++ = *s;
+            continue;
+        }
+
+        *p++ = '\\';
+        *p++ = 'x';
+        *p++ = hex[*s >> 4];
+        *p++ = hex[*s & 0xf];
+    }
+
+    truncated = (sink->sent + (b->last - b->pos)
+                 > (off_t) (log->last - log->pos));
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client request body: \"%*s\"%s",
+                  (size_t) (p - dst), dst, truncated ? "..." : "");
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_body_tee_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_body_tee_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_body_tee_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->file = NULL;
+     */
+
+    conf->log_size = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_body_tee_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_body_tee_conf_t *prev = parent;
+    ngx_http_body_tee_conf_t *conf = child;
+
+    if (conf->file == NULL) {
+        conf->file = prev->file;
+    }
+
+    ngx_conf_merge_size_value(conf->log_size, prev->log_size, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_body_tee_used(ngx_http_request_t *r)
+{
+    ngx_http_body_tee_conf_t  *conf;
+
+    /* the sinks added for the request have to get the data as well */
+
+    if (ngx_http_get_module_ctx(r, ngx_http_body_tee_filter_module)) {
+        return 1;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_body_tee_filter_module);
+
+    return conf->file != NULL || conf->log_size != 0;
+}
+
+
+static ngx_int_t
+ngx_http_body_tee_init(ngx_conf_t *cf)
+{
+    ngx_http_next_input_body_filter = ngx_http_top_input_body_filter;
+    ngx_http_top_input_body_filter = ngx_http_body_tee_filter;
+
+    return ngx_http_request_body_filter_used(cf,
+                                             ngx_http_next_input_body_filter,
+                                             ngx_http_body_tee_used);
+}
@@ -7,14 +7,782 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <sys/file.h>
 
+#if (NGX_HAVE_LZ4)
+#include <lz4.h>
+#endif
 
+
+#define NGX_HTTP_REQUEST_BODY_DISCARD_TRUNC  (1024 * 1024)
+
+
+#define NGX_HTTP_REQUEST_BODY_HIST_BUCKETS  32
+#define NGX_HTTP_REQUEST_BODY_HIST_UPDATE   64
+#define NGX_HTTP_REQUEST_BODY_HIST_DECAY    65536
+
+
+/*
+ * bucket n counts the bodies of up to 2^n bytes,
+ * the histogram is private to a worker
+ */
+
+typedef struct ngx_http_request_body_hist_s  ngx_http_request_body_hist_t;
+
+struct ngx_http_request_body_hist_s {
+    ngx_str_t                         name;
+    size_t                            budget;
+    size_t                            size;
+    ngx_uint_t                        total;
+    ngx_uint_t                        samples;
+    ngx_uint_t                        buckets[NGX_HTTP_REQUEST_BODY_HIST_BUCKETS];
+    ngx_uint_t                        single;
+    ngx_http_request_body_hist_t     *next;
+};
+
+
+typedef struct {
+    ngx_flag_t                        aio;
+    ngx_flag_t                        splice;
+    size_t                            memory_spool;
+    ngx_flag_t                        buffer_pool;
+    size_t                            adaptive;
+    ngx_http_request_body_hist_t     *hist;
+    ngx_bufs_t                        bufs;
+    off_t                             discard_max;
+    size_t                            read_budget;
+    ngx_msec_t                        read_budget_time;
+    size_t                            memory_budget;
+    ngx_flag_t                        memory_shared;
+    ngx_flag_t                        preallocate;
+    ngx_flag_t                        tmpfile;
+    ngx_uint_t                        spool_files;
+    size_t                            directio;
+    ngx_flag_t                        preread_copy;
+    ngx_http_complex_value_t         *resumable;
+    ngx_uint_t                        filter_inflight;
+#if (NGX_HAVE_LZ4)
+    ngx_flag_t                        lz4;
+#endif
+#if (NGX_THREADS)
+    ngx_thread_pool_t                *thread_pool;
+#endif
+} ngx_http_request_body_loc_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                        state;
+    off_t                             size;
+    off_t                             length;
+} ngx_http_request_body_chunked_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_file_t                       *file;
+    ngx_chain_t                      *chain;
+    off_t                             offset;
+    ngx_pool_t                       *pool;
+    ssize_t                           written;
+    uint64_t                          usec;
+} ngx_http_request_body_thread_ctx_t;
+
+#endif
+
+
+typedef struct {
+    void                             *addr;
+    size_t                            size;
+    ngx_log_t                        *log;
+} ngx_http_request_body_map_t;
+
+
+/*
+ * a part of a resumable upload: the bytes from start are appended to
+ * the partial file of size bytes, total is -1 while the size of the
+ * object is not known; the upload is in the worker's list of uploads
+ * in progress until the request is freed
+ */
+
+typedef struct {
+    ngx_queue_t                       queue;
+    ngx_str_t                         id;
+    off_t                             start;
+    off_t                             total;
+    off_t                             size;
+    ngx_pool_cleanup_t               *cleanup;
+    ngx_http_client_body_handler_pt   post_handler;
+} ngx_http_request_body_resume_t;
+
+
+#define NGX_HTTP_REQUEST_BODY_RESUME_INCOMPLETE  308
+
+
+/*
+ * the unnamed temp files of a worker, truncated and ready to be reused
+ * by the next body spooled to the same path
+ */
+
+typedef struct ngx_http_request_body_spool_s  ngx_http_request_body_spool_t;
+
+struct ngx_http_request_body_spool_s {
+    ngx_path_t                       *path;
+    ngx_fd_t                         *fds;
+    ngx_uint_t                        nfds;
+    ngx_uint_t                        max;
+    ngx_http_request_body_spool_t    *next;
+};
+
+
+typedef struct {
+    ngx_fd_t                          fd;
+    ngx_file_t                       *file;
+    ngx_http_request_body_spool_t    *spool;
+    ngx_log_t                        *log;
+} ngx_http_request_body_spool_file_t;
+
+
+/*
+ * the body buffers are kept in per worker free lists of power of two
+ * size classes from 4K to 1M, larger buffers are not recycled
+ */
+
+#define NGX_HTTP_REQUEST_BODY_POOL_SHIFT    12
+#define NGX_HTTP_REQUEST_BODY_POOL_CLASSES  9
+#define NGX_HTTP_REQUEST_BODY_POOL_FREE     64
+
+
+typedef struct ngx_http_request_body_free_s  ngx_http_request_body_free_t;
+
+struct ngx_http_request_body_free_s {
+    ngx_http_request_body_free_t     *next;
+};
+
+
+typedef struct {
+    ngx_http_request_body_free_t     *free;
+    ngx_uint_t                        nfree;
+} ngx_http_request_body_class_t;
+
+
+typedef struct {
+    u_char                           *start;
+    size_t                            size;
+    ngx_uint_t                        class;
+    size_t                           *held;
+} ngx_http_request_body_pooled_t;
+
+
+typedef struct {
+    off_t                             bytes;
+    ngx_uint_t                        closed;
+    ngx_uint_t                        refused;
+} ngx_http_request_body_discard_stat_t;
+
+
+#if (NGX_HAVE_LZ4)
+
+/*
+ * a part of the body spooled with "client_body_spool_lz4", it is stored
+ * as is when it does not compress
+ */
+
+typedef struct {
+    off_t                             start;
+    off_t                             offset;
+    uint32_t                          size;
+    uint32_t                          length;
+} ngx_http_request_body_lz4_block_t;
+
+
+typedef struct {
+    off_t                             length;
+    off_t                             written;
+    ngx_uint_t                        blocks;
+    ngx_uint_t                        stored;
+} ngx_http_request_body_lz4_stat_t;
+
+#endif
+
+
+#define NGX_HTTP_REQUEST_BODY_STAT_BUCKETS  24
+
+#define NGX_HTTP_REQUEST_BODY_BUFFERED      0
+#define NGX_HTTP_REQUEST_BODY_SINGLE_BUF    1
+#define NGX_HTTP_REQUEST_BODY_FILE_ONLY     2
+#define NGX_HTTP_REQUEST_BODY_UNBUFFERED    3
+
+
+/* bucket n counts the values of up to 2^n, the last one all the larger */
+
+typedef struct {
+    ngx_uint_t                        bodies;
+    ngx_uint_t                        modes[4];
+    off_t                             preread;
+    off_t                             spilled;
+    ngx_uint_t                        yields;
+    ngx_uint_t                        yielded;
+    ngx_uint_t                        filtered;
+    ngx_uint_t                        filter_waits;
+    ngx_uint_t                        read_time[NGX_HTTP_REQUEST_BODY_STAT_BUCKETS];
+    ngx_uint_t                        spill_time[NGX_HTTP_REQUEST_BODY_STAT_BUCKETS];
+    ngx_uint_t                        recvs[NGX_HTTP_REQUEST_BODY_STAT_BUCKETS];
+    ngx_uint_t                        agains[NGX_HTTP_REQUEST_BODY_STAT_BUCKETS];
+} ngx_http_request_body_read_stat_t;
+
+
+typedef struct {
+    ngx_uint_t                        hits;
+    ngx_uint_t                        misses;
+    ngx_uint_t                        busy;
+    ngx_uint_t                        busy_max;
+    size_t                            busy_size;
+    ngx_uint_t                        forced;
+    ngx_uint_t                        spool_hits;
+    ngx_uint_t                        spool_opens;
+} ngx_http_request_body_pool_stat_t;
+
+
+/* a part held by a filter task, kept in the order it was received */
+
+struct ngx_http_request_body_part_s {
+    ngx_buf_t                         buf;
+    ngx_http_input_body_filter_pt     next;
+    ngx_int_t                         rc;
+    ngx_queue_t                       queue;
+    unsigned                          done:1;
+};
+
+
+/*
+ * ngx_http_request_body_t is always allocated as a part of this structure,
+ * so r->request_body can be casted to it
+ */
+
+typedef struct {
+    ngx_http_request_body_t           rb;
+
+    ngx_http_request_body_chunked_t   chunked;
+    off_t                             received;
+
+    ngx_http_client_body_data_handler_pt  data_handler;
+    ngx_buf_t                         data_buf;
+    ngx_buf_t                        *pending;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t                *thread_pool;
+    ngx_thread_task_t                *task;
+    ngx_buf_t                        *spare;
+#endif
+
+#if (NGX_LINUX)
+    ngx_fd_t                          pipe[2];
+    size_t                            piped;
+    size_t                            pipe_size;
+
+    ngx_pool_cleanup_t               *memfd_cleanup;
+#endif
+
+    /* the readv() buffers, the first nlinks of them are in rb->bufs */
+    ngx_chain_t                      *links;
+    ngx_chain_t                      *recv;
+    ngx_uint_t                        nlinks;
+    ngx_uint_t                        current;
+
+    /* the data saved by a filter that replaces the body */
+    ngx_chain_t                      *out;
+    ngx_chain_t                     **last_out;
+    size_t                            out_size;
+    off_t                             saved;
+
+    /* the times are in milliseconds since the start of the request */
+    ngx_msec_t                        first_byte;
+    ngx_msec_t                        last_byte;
+    ngx_uint_t                        recvs;
+    ngx_uint_t                        agains;
+    size_t                            preread;
+    off_t                             spilled;
+    uint64_t                          spill_usec;
+    ngx_uint_t                        mode;
+
+    /* what has been read since the read event was posted */
+    size_t                            event_bytes;
+    uint64_t                          event_start;
+    ngx_uint_t                        yields;
+
+    /* the body buffers allocated, the bodies to be kept in memory */
+    size_t                            held;
+    ngx_queue_t                       queue;
+
+#if (NGX_HAVE_O_DIRECT)
+    /* the aligned buffer the data are collected in for direct writes */
+    ngx_buf_t                        *directio;
+#endif
+
+    ngx_http_request_body_resume_t   *resume;
+
+#if (NGX_HAVE_LZ4)
+    /* the blocks of the temp file, the body length they hold */
+    ngx_array_t                      *lz4;
+    off_t                             lz4_length;
+
+    /* the compressed data, the last block decompressed */
+    u_char                           *lz4_buf;
+    size_t                            lz4_size;
+    u_char                           *lz4_out;
+    size_t                            lz4_out_size;
+    ngx_uint_t                        lz4_cached;
+#endif
+
+    /* the part of "100 Continue" sent, the handler it interrupted */
+    size_t                            continue_sent;
+    ngx_http_event_handler_pt         write_event_handler;
+
+    /* the parts held by the filters until their tasks are done */
+    ngx_queue_t                       parts;
+    ngx_queue_t                       free_parts;
+    ngx_http_request_body_part_t     *handoff;
+    ngx_queue_t                      *handoff_last;
+    ngx_uint_t                        filtering;
+    ngx_int_t                         filter_rc;
+
+    unsigned                          chunked_body:1;
+    unsigned                          paused:1;
+    unsigned                          aio_busy:1;
+    unsigned                          aio_waiting:1;
+    unsigned                          aio_last:1;
+    unsigned                          splice:1;
+    unsigned                          memfd:1;
+    unsigned                          readv:1;
+    unsigned                          replaced:1;
+    unsigned                          first:1;
+    unsigned                          spill:1;
+    unsigned                          spilled_buffers:1;
+    unsigned                          queued:1;
+    unsigned                          expect:1;
+    unsigned                          blocked:1;
+    unsigned                          done:1;
+    unsigned                          filter_wait:1;
+    unsigned                          filter_preread:1;
+    unsigned                          filter_sync:1;
+    unsigned                          filter_async:1;
+    unsigned                          compressed:1;
+} ngx_http_request_body_ctx_t;
+
+
+#define ngx_http_request_body_ctx(r)                                          \
+    ((ngx_http_request_body_ctx_t *) (r)->request_body)
+
+
+static ngx_int_t ngx_http_read_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_data_handler_pt data_handler,
+    ngx_http_client_body_handler_pt post_handler, ngx_uint_t compressed);
+static ngx_int_t ngx_http_request_body_preread_done(ngx_http_request_t *r);
 static void ngx_http_read_client_request_body_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_do_read_client_request_body(ngx_http_request_t *r);
 static ngx_int_t ngx_http_write_request_body(ngx_http_request_t *r,
     ngx_chain_t *body);
+#if (NGX_HAVE_O_DIRECT)
+static ngx_int_t ngx_http_request_body_directio_init(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_directio_write(ngx_http_request_t *r,
+    ngx_chain_t *body);
+static ngx_int_t ngx_http_request_body_directio_flush(ngx_http_request_t *r,
+    size_t size, ngx_uint_t direct);
+#endif
+#if (NGX_HAVE_LZ4)
+static ngx_int_t ngx_http_request_body_lz4_init(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_lz4_write(ngx_http_request_t *r,
+    ngx_chain_t *body);
+static ssize_t ngx_http_request_body_lz4_read(ngx_http_request_t *r,
+    u_char *buf, size_t size, off_t offset);
+static u_char *ngx_http_request_body_lz4_alloc(ngx_http_request_t *r,
+    u_char **p, size_t *size, size_t need);
+#endif
 static ngx_int_t ngx_http_read_discarded_request_body(ngx_http_request_t *r);
-static ngx_int_t ngx_http_test_expect(ngx_http_request_t *r);
+#if (NGX_LINUX)
+static ssize_t ngx_http_request_body_recv_trunc(ngx_connection_t *c,
+    size_t size);
+#endif
+static ngx_uint_t ngx_http_test_expect(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_send_continue(ngx_http_request_t *r);
+static void ngx_http_request_body_continue_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_call_filter(ngx_http_request_t *r,
+    ngx_buf_t *in, ngx_buf_t *b);
+static void ngx_http_request_body_filter_hold(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_filter_wait(ngx_http_request_t *r);
+static void ngx_http_request_body_filter_pass(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_save_done(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_request_body_readv_enabled(ngx_http_request_t *r);
+static ngx_chain_t *ngx_http_request_body_readv_init(ngx_http_request_t *r);
+static ngx_buf_t *ngx_http_request_body_readv_alloc(ngx_http_request_t *r,
+    off_t rest);
+static ngx_int_t ngx_http_do_readv_client_request_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_deliver(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static void ngx_http_request_body_consumed(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static ngx_uint_t ngx_http_request_body_is_chunked(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_chunked(ngx_http_request_t *r,
+    ngx_buf_t *b, u_char **dst);
+static ngx_int_t ngx_http_request_body_parse_chunked(ngx_http_request_t *r,
+    ngx_buf_t *b, ngx_http_request_body_chunked_t *ctx);
+
+static void ngx_http_request_body_unmap(void *data);
+
+static ngx_buf_t *ngx_http_request_body_alloc_buf(ngx_http_request_t *r,
+    size_t size);
+static void ngx_http_request_body_free_buf(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static void ngx_http_request_body_pool_cleanup(void *data);
+static void ngx_http_request_body_release(ngx_http_request_t *r);
+static size_t ngx_http_request_body_memory_held(ngx_http_request_t *r);
+static void ngx_http_request_body_memory_check(ngx_http_request_t *r,
+    size_t size);
+static ngx_int_t ngx_http_request_body_memory_spill(ngx_http_request_t *r);
+static void ngx_http_request_body_memory_done(ngx_http_request_t *r);
+static void ngx_http_request_body_memory_cleanup(void *data);
+
+static size_t ngx_http_request_body_buffer_size(ngx_http_request_t *r);
+static void ngx_http_request_body_hist_add(ngx_http_request_t *r, off_t len);
+static void ngx_http_request_body_hist_update(
+    ngx_http_request_body_hist_t *hist);
+
+static ngx_msec_t ngx_http_request_body_elapsed(ngx_http_request_t *r);
+static uint64_t ngx_http_request_body_usec(void);
+static void ngx_http_request_body_recv_stat(ngx_http_request_t *r, ssize_t n);
+static void ngx_http_request_body_read_done(ngx_http_request_t *r);
+static void ngx_http_request_body_budget_init(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_request_body_budget_spent(ngx_http_request_t *r);
+static void ngx_http_request_body_yield(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_request_body_stat_bucket(uint64_t value);
+static ngx_int_t ngx_http_request_body_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_request_body_status_handler(ngx_http_request_t *r);
+static char *ngx_http_request_body_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_request_body_thread_flush(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_thread_write(ngx_http_request_t *r,
+    ngx_chain_t *body);
+static void ngx_http_request_body_thread_write_handler(void *data,
+    ngx_log_t *log);
+static void ngx_http_request_body_thread_event_handler(ngx_event_t *ev);
+static void ngx_http_request_body_thread_wait(ngx_http_request_t *r);
+#endif
+
+#if (NGX_LINUX)
+static ngx_uint_t ngx_http_request_body_splice_enabled(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_splice_init(ngx_http_request_t *r);
+static void ngx_http_request_body_splice_cleanup(void *data);
+static ngx_int_t ngx_http_do_splice_client_request_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_request_body_memfd_create(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+static ngx_int_t ngx_http_request_body_memfd_check(ngx_http_request_t *r,
+    ngx_chain_t *body);
+#endif
+static ngx_int_t ngx_http_request_body_spool_open(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+#if (NGX_LINUX) && defined O_TMPFILE
+static ngx_int_t ngx_http_request_body_tmpfile(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+static void ngx_http_request_body_spool_cleanup(void *data);
+#endif
+
+static ngx_int_t ngx_http_request_body_resumable_init(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler);
+static ngx_int_t ngx_http_request_body_content_range(ngx_http_request_t *r,
+    ngx_http_request_body_resume_t *rs);
+static void ngx_http_request_body_resumable_cleanup(void *data);
+static void ngx_http_request_body_resumable_handler(ngx_http_request_t *r);
+static void ngx_http_request_body_resumable_reply(ngx_http_request_t *r,
+    off_t size);
+
+static ngx_int_t ngx_http_request_body_preconf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_request_body_init(ngx_conf_t *cf);
+static void *ngx_http_request_body_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_request_body_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_request_body_aio(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_request_body_memory_budget(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_request_body_memory_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+
+
+static ngx_command_t  ngx_http_request_body_commands[] = {
+
+    { ngx_string("client_body_aio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_request_body_aio,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("client_body_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, splice),
+      NULL },
+
+    { ngx_string("client_body_memory_spool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, memory_spool),
+      NULL },
+
+    { ngx_string("client_body_buffer_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, buffer_pool),
+      NULL },
+
+    { ngx_string("client_body_buffer_adaptive"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, adaptive),
+      NULL },
+
+    { ngx_string("client_body_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, bufs),
+      NULL },
+
+    { ngx_string("client_body_discard_max"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, discard_max),
+      NULL },
+
+    { ngx_string("client_body_read_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, read_budget),
+      NULL },
+
+    { ngx_string("client_body_read_budget_time"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, read_budget_time),
+      NULL },
+
+    { ngx_string("client_body_preallocate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, preallocate),
+      NULL },
+
+    { ngx_string("client_body_tmpfile"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, tmpfile),
+      NULL },
+
+    { ngx_string("client_body_directio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, directio),
+      NULL },
+
+    { ngx_string("client_body_preread_copy"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, preread_copy),
+      NULL },
+
+    { ngx_string("client_body_filter_inflight"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, filter_inflight),
+      NULL },
+
+#if (NGX_HAVE_LZ4)
+
+    { ngx_string("client_body_spool_lz4"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, lz4),
+      NULL },
+
+#endif
+
+    { ngx_string("client_body_resumable"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, resumable),
+      NULL },
+
+    { ngx_string("client_body_spool_files"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_request_body_loc_conf_t, spool_files),
+      NULL },
+
+    { ngx_string("client_body_memory_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_request_body_memory_budget,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("client_body_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_request_body_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_request_body_module_ctx = {
+    ngx_http_request_body_preconf,         /* preconfiguration */
+    ngx_http_request_body_init,            /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_request_body_create_loc_conf, /* create location configuration */
+    ngx_http_request_body_merge_loc_conf   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_request_body_module = {
+    NGX_MODULE_V1,
+    &ngx_http_request_body_module_ctx,     /* module context */
+    ngx_http_request_body_commands,        /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+#define NGX_HTTP_REQUEST_BODY_VAR_FIRST_BYTE  0
+#define NGX_HTTP_REQUEST_BODY_VAR_LAST_BYTE   1
+#define NGX_HTTP_REQUEST_BODY_VAR_RECVS       2
+#define NGX_HTTP_REQUEST_BODY_VAR_AGAINS      3
+#define NGX_HTTP_REQUEST_BODY_VAR_PREREAD     4
+#define NGX_HTTP_REQUEST_BODY_VAR_SPILLED     5
+#define NGX_HTTP_REQUEST_BODY_VAR_SPILL_TIME  6
+#define NGX_HTTP_REQUEST_BODY_VAR_MODE        7
+#define NGX_HTTP_REQUEST_BODY_VAR_YIELDS      8
+
+
+static ngx_http_variable_t  ngx_http_request_body_vars[] = {
+
+    { ngx_string("request_body_first_byte_time"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_FIRST_BYTE,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_last_byte_time"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_LAST_BYTE,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_recv_calls"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_RECVS,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_recv_again"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_AGAINS,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_preread"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_PREREAD,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_spilled"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_SPILLED,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_spill_time"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_SPILL_TIME,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_mode"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_MODE,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_body_read_yields"), NULL,
+      ngx_http_request_body_variable, NGX_HTTP_REQUEST_BODY_VAR_YIELDS,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+static ngx_str_t  ngx_http_request_body_modes[] = {
+    ngx_string("buffered"),
+    ngx_string("single_buf"),
+    ngx_string("file_only"),
+    ngx_string("unbuffered")
+};
+
+
+/* the input body filter installed before any filter module */
+static ngx_http_input_body_filter_pt  ngx_http_request_body_last_filter;
+
+/*
+ * the handlers telling whether the filters are used for a request,
+ * the filter on top when the last one was added and whether a filter
+ * was added without one
+ */
+static ngx_array_t                   *ngx_http_request_body_used;
+static ngx_http_input_body_filter_pt  ngx_http_request_body_checked_filter;
+static ngx_uint_t                     ngx_http_request_body_unchecked;
+
+static ngx_http_request_body_class_t
+    ngx_http_request_body_classes[NGX_HTTP_REQUEST_BODY_POOL_CLASSES];
+
+static ngx_http_request_body_pool_stat_t  ngx_http_request_body_pool_stat;
+static ngx_http_request_body_discard_stat_t  ngx_http_request_body_discard_stat;
+#if (NGX_HAVE_LZ4)
+static ngx_http_request_body_lz4_stat_t  ngx_http_request_body_lz4_stat;
+#endif
+static ngx_http_request_body_read_stat_t  ngx_http_request_body_read_stat;
+
+/* the bodies of this worker that are to be kept in memory once read */
+static ngx_queue_t  ngx_http_request_body_inflight;
+
+/* the resumable uploads this worker is receiving a part of */
+static ngx_queue_t  ngx_http_request_body_uploads;
+
+/* the body buffers of all the workers, in the shared memory zone */
+static ngx_atomic_t  *ngx_http_request_body_shared;
+
+static ngx_http_request_body_spool_t  *ngx_http_request_body_spools;
+static ngx_uint_t  ngx_http_request_body_no_tmpfile;
+
+/* the histograms of the locations with client_body_buffer_adaptive */
+static ngx_http_request_body_hist_t  *ngx_http_request_body_hists;
 
 
 /*
@@ -30,13 +798,55 @@ ngx_int_t
 ngx_http_read_client_request_body(ngx_http_request_t *r,
     ngx_http_client_body_handler_pt post_handler)
 {
-    size_t                     preread;
-    ssize_t                    size;
-    ngx_buf_t                 *b, buf;
-    ngx_int_t                  rc;
-    ngx_chain_t               *cl, **next;
-    ngx_http_request_body_t   *rb;
-    ngx_http_core_loc_conf_t  *clcf;
+    return ngx_http_read_request_body(r, NULL, post_handler, 0);
+}
+
+
+/*
+ * the consumer reads the spooled body with ngx_http_request_body_read_file()
+ * or ngx_http_request_body_map() only, so it may be kept compressed
+ */
+
+ngx_int_t
+ngx_http_read_compressed_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler)
+{
+    return ngx_http_read_request_body(r, NULL, post_handler, 1);
+}
+
+
+/*
+ * the body is not buffered: every received part is passed to data_handler
+ * and rb->buf is reused as soon as the handler has consumed it
+ */
+
+ngx_int_t
+ngx_http_read_unbuffered_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_data_handler_pt data_handler,
+    ngx_http_client_body_handler_pt post_handler)
+{
+    r->request_body_in_file_only = 0;
+    r->request_body_in_single_buf = 0;
+
+    return ngx_http_read_request_body(r, data_handler, post_handler, 0);
+}
+
+
+static ngx_int_t
+ngx_http_read_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_data_handler_pt data_handler,
+    ngx_http_client_body_handler_pt post_handler, ngx_uint_t compressed)
+{
+    off_t                              fit;
+    u_char                            *last;
+    size_t                             preread;
+    ssize_t                            size;
+    ngx_buf_t                         *b, buf;
+    ngx_int_t                          rc;
+    ngx_chain_t                       *cl, **next;
+    ngx_http_request_body_t           *rb;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
     /* 增加主请求的引用数，这个字段主要是在ngx_http_finalize_request调用的一些结束请求和 
        连接的函数中使用 */ 
     r->main->count++;
@@ -58,26 +868,97 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
         post_handler(r);
         return NGX_OK;
     }
-    /*处理Http 1.1 的expect请求头,如请求头中有 expect: "100-continue",则向客户端发送continue应答*/
-    if (ngx_http_test_expect(r) != NGX_OK) {
-        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        goto done;
-    }
-    
-    rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t));
-    if (rb == NULL) {
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_ctx_t));
+    if (ctx == NULL) {
         rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
         goto done;
     }
-    
+
+    rb = &ctx->rb;
     r->request_body = rb;
-    
+
+    ngx_queue_init(&ctx->parts);
+    ngx_queue_init(&ctx->free_parts);
+
+    ctx->data_handler = data_handler;
+    ctx->compressed = compressed;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+#if (NGX_THREADS)
+    if (data_handler == NULL) {
+        ctx->thread_pool = rblcf->thread_pool;
+    }
+#endif
+
     if (r->headers_in.content_length_n < 0) {
-        post_handler(r);
-        return NGX_OK;
+
+        if (!ngx_http_request_body_is_chunked(r)) {
+            post_handler(r);
+            return NGX_OK;
+        }
+
+        /*chunked的body长度未知，rb->rest只是解析器估算的至少还需读取的字节数*/
+        ctx->chunked_body = 1;
+        rb->rest = 3 /* "0" LF LF */;
+
+    } else if (rblcf->hist) {
+        ngx_http_request_body_hist_add(r, r->headers_in.content_length_n);
+
+        /*
+         * a body expected to fit in the buffer is kept contiguous;
+         * with "client_body_preread_copy off" the part preread with
+         * the header is left in place instead, and the consumer joins
+         * the parts with ngx_http_request_body_contiguous() if needed
+         */
+
+        if (rblcf->hist->single
+            && rblcf->preread_copy
+            && data_handler == NULL
+            && !r->request_body_in_file_only
+            && r->headers_in.content_length_n
+               <= (off_t) ngx_http_request_body_buffer_size(r))
+        {
+            r->request_body_in_single_buf = 1;
+        }
+    }
+
+    /*
+     * 处理Http 1.1 的expect请求头: "100 Continue"推迟到第一次从socket读body时
+     * 才发送，在此之前以错误结束请求的handler不会让客户端发送body
+     */
+    if (r->headers_in.content_length_n != 0) {
+        ctx->expect = ngx_http_test_expect(r);
+    }
+
+    if (rblcf->resumable && data_handler == NULL) {
+        rc = ngx_http_request_body_resumable_init(r, post_handler);
+
+        if (rc == NGX_OK) {
+            post_handler = ngx_http_request_body_resumable_handler;
+
+        } else if (rc != NGX_DECLINED) {
+            if (rc == NGX_ERROR) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            goto done;
+        }
+    }
+
+    if (data_handler) {
+        ctx->mode = NGX_HTTP_REQUEST_BODY_UNBUFFERED;
+
+    } else if (r->request_body_in_file_only) {
+        ctx->mode = NGX_HTTP_REQUEST_BODY_FILE_ONLY;
+
+    } else if (r->request_body_in_single_buf) {
+        ctx->mode = NGX_HTTP_REQUEST_BODY_SINGLE_BUF;
+
+    } else {
+        ctx->mode = NGX_HTTP_REQUEST_BODY_BUFFERED;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     /*content_length为0表示body为空，nginx会只去新建一个temp_file*/
     if (r->headers_in.content_length_n == 0) {
         /*r->request_body_in_file_only 表示设定为每个body都存放到临时文件里*/
@@ -112,6 +993,15 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http client request body preread %uz", preread);
+
+        /* the client is already sending the body, "100 Continue" is omitted */
+
+        ctx->expect = 0;
+
+        ctx->preread = preread;
+        ctx->first_byte = ngx_http_request_body_elapsed(r);
+        ctx->last_byte = ctx->first_byte;
+        ctx->first = 1;
         /*这个b最终会挂到rb->bufs链中去*/
         b = ngx_calloc_buf(r->pool);
         if (b == NULL) {
@@ -125,14 +1015,47 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
         b->pos = r->header_in->pos;
         b->last = r->header_in->last;
         b->end = r->header_in->end;
+
+        if (ctx->chunked_body) {
+
+            /*
+             * decode the chunked framing in place: the payload is moved
+             * to the start of the preread part and r->header_in->pos is
+             * left right after the last parsed byte
+             */
+
+            last = r->header_in->pos;
+
+            rc = ngx_http_request_body_chunked(r, r->header_in, &last);
+            if (rc != NGX_OK) {
+                goto done;
+            }
+
+            r->request_length += r->header_in->pos - b->start;
+
+            b->last = last;
+            preread = last - b->pos;
+        }
 	/*让buf也指向header_in结构体，注意：buf的last字段指向的是content_length表示的有效内存区,截断了preread多出来的部分*/
         ngx_memzero(&buf, sizeof(ngx_buf_t));
         buf.memory = 1;
-        buf.start = r->header_in->pos;
-        buf.pos = r->header_in->pos;
-        buf.last = (off_t) preread >= r->headers_in.content_length_n
-                 ? r->header_in->pos + (size_t) r->headers_in.content_length_n
-                 : r->header_in->last;
+        buf.start = b->pos;
+        buf.pos = b->pos;
+
+        /* the filters learn from last_buf that the body is complete */
+
+        if (ctx->chunked_body) {
+            buf.last = b->last;
+            buf.last_buf = (rb->rest == 0);
+
+        } else {
+            buf.last = (off_t) preread >= r->headers_in.content_length_n
+                     ? b->pos + (size_t) r->headers_in.content_length_n
+                     : b->last;
+            buf.last_buf = ((off_t) preread
+                            >= r->headers_in.content_length_n);
+        }
+
         buf.end = r->header_in->end;
 
         rb->bufs = ngx_alloc_chain_link(r->pool);
@@ -147,6 +1070,14 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
         rb->buf = b;
 	/*TODO:开始进入input_body_filter处理链？*/
         rc = ngx_http_top_input_body_filter(r, &buf);
+
+        if (rc == NGX_AGAIN) {
+
+            /* the part is kept in r->header_in until the task is done */
+
+            rc = NGX_OK;
+        }
+
         if (rc != NGX_OK) {
             if (rc > NGX_OK && rc < NGX_HTTP_SPECIAL_RESPONSE) {
                 ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -157,17 +1088,37 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
             /**
              * NGX_OK: success and continue;
              * NGX_ERROR: failed and exit;
-             * NGX_AGAIN: not ready and retry later.
+             * NGX_AGAIN: the part is filtered by a task, see
+             *            ngx_http_request_body_filter_done().
              */
 
-            if (rc < NGX_HTTP_SPECIAL_RESPONSE && rc != NGX_AGAIN) {
+            if (rc < NGX_HTTP_SPECIAL_RESPONSE) {
                 rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
 
             return rc;
         }
 
-        if ((off_t) preread >= r->headers_in.content_length_n) {
+        if (ctx->replaced) {
+
+            /* the filter has saved what it needs from the preread part */
+
+            rb->bufs = NULL;
+        }
+
+        if (ctx->chunked_body && rb->rest == 0) {
+
+            /* the whole chunked request body was pre-read */
+
+            r->headers_in.content_length_n = ctx->received;
+
+            rc = ngx_http_request_body_preread_done(r);
+            goto done;
+        }
+
+        if (!ctx->chunked_body
+            && (off_t) preread >= r->headers_in.content_length_n)
+        {
 
             /* the whole request body was pre-read */
 	    /*把pos移到读到的body的最后位置，并更新各个数据*/
@@ -175,17 +1126,8 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
             r->request_length += r->headers_in.content_length_n;
             b->last = r->header_in->pos;
 
-            if (r->request_body_in_file_only) {
-                /*很明显的函数名字，将rb->bufs中的内容写入r->temp_file中*/
-                if (ngx_http_write_request_body(r, rb->bufs) != NGX_OK) {
-                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-                    goto done;
-                }
-            }
-            /*到此时body已接收完整，调用post_handler*/
-            post_handler(r);
-
-            return NGX_OK;
+            rc = ngx_http_request_body_preread_done(r);
+            goto done;
         }
 
         /*
@@ -193,12 +1135,25 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
          * ngx_http_set_keepalive()
          */
         r->header_in->pos = r->header_in->last;
-	/*request_length为已读取到body的长度,加上新读到的prereads个字节*/
-        r->request_length += preread;
-        
-        rb->rest = r->headers_in.content_length_n - preread;
-        /*判断剩余的数据是否比一个buf的剩余空间还大*/
-        if (rb->rest <= (off_t) (b->end - b->last)) {
+
+        if (!ctx->chunked_body) {
+	    /*request_length为已读取到body的长度,加上新读到的prereads个字节*/
+            r->request_length += preread;
+
+            rb->rest = r->headers_in.content_length_n - preread;
+        }
+
+        if (data_handler) {
+            rc = ngx_http_request_body_deliver(r, b);
+            if (rc != NGX_OK && rc != NGX_AGAIN) {
+                goto done;
+            }
+        }
+        /*判断剩余的数据是否比一个buf的剩余空间还大，chunked的rest只是估算值，不能用来判断*/
+        if (!ctx->chunked_body
+            && data_handler == NULL
+            && rb->rest <= (off_t) (b->end - b->last))
+        {
             /*如果小于或等于,则所有body可放在一个buf里*/
             /* the whole request body may be placed in r->header_in */
 
@@ -210,81 +1165,213 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
             goto done;
         }
         /*如果剩余数据过大，一个buf里放不下的话*/
-        next = &rb->bufs->next;
+        next = rb->bufs ? &rb->bufs->next : &rb->bufs;
 
     } else {
         b = NULL;
-        rb->rest = r->headers_in.content_length_n;
+
+        if (!ctx->chunked_body) {
+            rb->rest = r->headers_in.content_length_n;
+        }
+
         next = &rb->bufs;
     }
 
-    size = clcf->client_body_buffer_size;
-    size += size >> 2;
+#if (NGX_LINUX)
 
-    if (rb->rest < size) {
-        size = (ssize_t) rb->rest;
+    if (ngx_http_request_body_splice_enabled(r)) {
 
-        if (r->request_body_in_single_buf) {
-            size += preread;
+        /*
+         * the preread part is written to the temp file as is,
+         * the rest is moved socket -> pipe -> file by splice()
+         */
+
+        if (ngx_http_write_request_body(r, preread ? rb->bufs : NULL)
+            != NGX_OK)
+        {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
         }
 
-    } else {
-        size = clcf->client_body_buffer_size;
+        if (ngx_http_request_body_splice_init(r) != NGX_OK) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
 
-        /* disable copying buffer for r->request_body_in_single_buf */
-        b = NULL;
-    }
+        r->read_event_handler = ngx_http_read_client_request_body_handler;
 
-    rb->buf = ngx_create_temp_buf(r->pool, size);
-    if (rb->buf == NULL) {
-        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        rc = ngx_http_do_read_client_request_body(r);
         goto done;
     }
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
-        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        goto done;
-    }
+#endif
 
-    cl->buf = rb->buf;
-    cl->next = NULL;
+    if (rblcf->memory_budget
+        && data_handler == NULL
+        && !r->request_body_in_file_only)
+    {
+        if (ngx_http_request_body_readv_enabled(r)) {
 
-    if (b && r->request_body_in_single_buf) {
-        size = b->last - b->pos;
-        ngx_memcpy(rb->buf->pos, b->pos, size);
-        rb->buf->last += size;
+            /* readv() fills all the client_body_buffers buffers */
 
-        next = &rb->bufs;
+            size = rblcf->bufs.num * rblcf->bufs.size;
+            fit = size;
+
+        } else {
+            size = ngx_http_request_body_buffer_size(r);
+            fit = size + (size >> 2);
+        }
+
+        /* a larger body goes to a temp file anyway */
+
+        if (ctx->chunked_body || rb->rest <= fit) {
+            ngx_http_request_body_memory_check(r, ctx->chunked_body
+                                                  ? (size_t) size
+                                                  : (size_t) rb->rest);
+        }
     }
 
-    *next = cl;
+    if (ngx_http_request_body_readv_enabled(r)) {
 
-    if (r->request_body_in_file_only || r->request_body_in_single_buf) {
-        rb->to_write = rb->bufs;
+        /* the body is received with readv() into a chain of buffers */
+
+        cl = ngx_http_request_body_readv_init(r);
+        if (cl == NULL) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
 
     } else {
-        rb->to_write = rb->bufs->next ? rb->bufs->next : rb->bufs;
-    }
+        size = ngx_http_request_body_buffer_size(r);
+        size += size >> 2;
 
-    r->read_event_handler = ngx_http_read_client_request_body_handler;
+        if (ctx->chunked_body) {
+            size = ngx_http_request_body_buffer_size(r);
 
-    rc = ngx_http_do_read_client_request_body(r);
+            if (b && (size_t) size <= preread) {
+                b = NULL;
+            }
 
-done:
+        } else if (rb->rest < size && !ctx->spill) {
+            size = (ssize_t) rb->rest;
 
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        r->main->count--;
-    }
+            if (r->request_body_in_single_buf) {
+                size += preread;
+            }
 
-    return rc;
-}
+        } else {
+            size = ngx_http_request_body_buffer_size(r);
 
+            /* a body to spill is written out as the buffer fills */
 
-static void
-ngx_http_read_client_request_body_handler(ngx_http_request_t *r)
-{
-    ngx_int_t  rc;
+            if (rb->rest < size) {
+                size = (ssize_t) rb->rest;
+            }
+
+            /* disable copying buffer for r->request_body_in_single_buf */
+            b = NULL;
+        }
+
+        rb->buf = ngx_http_request_body_alloc_buf(r, size);
+        if (rb->buf == NULL) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        cl->buf = rb->buf;
+        cl->next = NULL;
+
+        if (b && r->request_body_in_single_buf && !ctx->replaced) {
+            size = b->last - b->pos;
+            ngx_memcpy(rb->buf->pos, b->pos, size);
+            rb->buf->last += size;
+
+            next = &rb->bufs;
+        }
+    }
+
+    *next = cl;
+
+    if (r->request_body_in_file_only || r->request_body_in_single_buf) {
+        rb->to_write = rb->bufs;
+
+    } else {
+        rb->to_write = rb->bufs->next ? rb->bufs->next : rb->bufs;
+    }
+
+    r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+    rc = ngx_http_do_read_client_request_body(r);
+
+done:
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        r->main->count--;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_preread_done(ngx_http_request_t *r)
+{
+    ngx_int_t                     rc;
+    ngx_http_request_body_t      *rb;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (ctx->filtering) {
+
+        /* the body is complete once the filters are done with it */
+
+        ctx->filter_preread = 1;
+
+        return ngx_http_request_body_filter_wait(r);
+    }
+
+    if (ctx->data_handler) {
+        rc = ngx_http_request_body_deliver(r, rb->buf);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (ctx->replaced) {
+        if (ngx_http_request_body_save_done(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+    } else if (r->request_body_in_file_only) {
+        /*将rb->bufs中的内容写入r->temp_file中，只有chunked的结束块时为空*/
+        if (ngx_http_write_request_body(r, rb->buf->pos < rb->buf->last
+                                           ? rb->bufs : NULL)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    /*到此时body已接收完整，调用post_handler*/
+    ngx_http_request_body_read_done(r);
+
+    rb->post_handler(r);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_read_client_request_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t  rc;
 
     if (r->connection->read->timedout) {
         r->connection->timedout = 1;
@@ -303,22 +1390,118 @@ ngx_http_read_client_request_body_handler(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_do_read_client_request_body(ngx_http_request_t *r)
 {
-    size_t                     size;
-    ssize_t                    n;
-    ngx_buf_t                 *b, buf;
-    ngx_int_t                  rc;
-    ngx_connection_t          *c;
-    ngx_http_request_body_t   *rb;
-    ngx_http_core_loc_conf_t  *clcf;
+    u_char                       *last;
+    size_t                        size;
+    ssize_t                       n;
+    ngx_buf_t                    *b, buf;
+    ngx_int_t                     rc;
+    ngx_uint_t                    yield;
+    ngx_chain_t                  *cl;
+    ngx_connection_t             *c;
+    ngx_http_request_body_t      *rb;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
 
     c = r->connection;
     rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http read client request body");
 
+    if (ctx->paused || ctx->blocked || ctx->filter_wait) {
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+
+        r->read_event_handler = ngx_http_block_reading;
+        return NGX_AGAIN;
+    }
+
+    if (ctx->expect) {
+
+        rc = ngx_http_request_body_send_continue(r);
+
+        if (rc == NGX_ERROR) {
+            c->error = 1;
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            /*
+             * the body is not read until "100 Continue" is sent in full,
+             * so no response may follow a part of it
+             */
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
+            r->read_event_handler = ngx_http_block_reading;
+            return NGX_AGAIN;
+        }
+    }
+
+    ngx_http_request_body_budget_init(r);
+
+#if (NGX_LINUX)
+    if (ctx->splice) {
+        return ngx_http_do_splice_client_request_body(r);
+    }
+#endif
+
+    if (rb->rest == 0) {
+
+        /* the whole body has been read, only the last write was pending */
+
+        goto complete;
+    }
+
+    if (ctx->spill && !ctx->spilled_buffers) {
+        rc = ngx_http_request_body_memory_spill(r);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (ctx->readv) {
+        rc = ngx_http_do_readv_client_request_body(r);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto complete;
+    }
+
     for ( ;; ) {
         for ( ;; ) {
+            if (rb->buf->last == rb->buf->end && ctx->filtering) {
+
+                /* the parts the filters hold are in the buffer */
+
+                return ngx_http_request_body_filter_wait(r);
+            }
+
+            if (rb->buf->last == rb->buf->end && ctx->data_handler) {
+                /*不缓存body，buf满了就交给data_handler处理*/
+                rc = ngx_http_request_body_deliver(r, rb->buf);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
+#if (NGX_THREADS)
+            if (rb->buf->last == rb->buf->end && ctx->thread_pool) {
+                /*异步写文件，写的同时继续往另一个buf里收数据*/
+                rc = ngx_http_request_body_thread_flush(r);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+#endif
+
             if (rb->buf->last == rb->buf->end) {
                 /*当ngx_http_read_client_body调用时，这里的rb->to_write是指向rb->bufs链*/
                 if (ngx_http_write_request_body(r, rb->to_write) != NGX_OK) {
@@ -340,6 +1523,8 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                            "http client request body recv %z", n);
+
+            ngx_http_request_body_recv_stat(r, n);
             /*设置了非阻塞读，可以先退出*/
             if (n == NGX_AGAIN) {
                 break;
@@ -361,25 +1546,50 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
             buf.pos = rb->buf->last;
             buf.last = buf.start + n;
             buf.end = buf.last;
-            /*FIXME nginx为什么不在recv里面自动更新buf->last，这样不是更方便吗？*/
-            rb->buf->last += n;
-            rb->rest -= n;
+
             /*更新已读取的数据长度*/
             r->request_length += n;
+
+            if (ctx->chunked_body) {
+
+                /*就地解码chunked，去掉分块格式后的数据紧接着放在rb->buf->last处*/
+                last = rb->buf->last;
+
+                rc = ngx_http_request_body_chunked(r, &buf, &last);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                buf.pos = buf.start;
+                buf.last = last;
+                buf.end = last;
+
+                rb->buf->last = last;
+
+            } else {
+                /*FIXME nginx为什么不在recv里面自动更新buf->last，这样不是更方便吗？*/
+                rb->buf->last += n;
+                rb->rest -= n;
+            }
             /*对新收到的数据再次调用过滤模块*/
-            rc = ngx_http_top_input_body_filter(r, &buf);
+            rc = ngx_http_request_body_call_filter(r, rb->buf, &buf);
             if (rc != NGX_OK) {
-                if (rc > NGX_OK && rc < NGX_HTTP_SPECIAL_RESPONSE) {
-                    ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "input filter: return code 1xx or 2xx "
-                              "will cause trouble and is converted to 500");
-                }
+                return rc;
+            }
 
-                if (rc < NGX_HTTP_SPECIAL_RESPONSE && rc != NGX_AGAIN) {
-                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            if (ctx->blocked || ctx->filter_wait) {
+
+                /*
+                 * a filter stopped reading until its consumer is drained,
+                 * or client_body_filter_inflight parts are being filtered
+                 */
+
+                if (c->read->timer_set) {
+                    ngx_del_timer(c->read);
                 }
 
-                return rc;
+                r->read_event_handler = ngx_http_block_reading;
+                return NGX_AGAIN;
             }
 
             if (rb->rest == 0) {
@@ -389,6 +1599,10 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
             if (rb->buf->last < rb->buf->end) {
                 break;
             }
+            /*本次事件读的数据量或时间超出预算，让出worker*/
+            if (ngx_http_request_body_budget_spent(r)) {
+                break;
+            }
         }
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -397,8 +1611,26 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         if (rb->rest == 0) {
             break;
         }
-        /*当连接为不可读的时候*/
-        if (!c->read->ready) {
+
+        yield = ngx_http_request_body_budget_spent(r);
+
+        if (yield) {
+            ngx_http_request_body_yield(r);
+        }
+        /*当连接为不可读的时候，或者已让出了worker*/
+        if (!c->read->ready || yield) {
+
+            if (ctx->data_handler) {
+                if (ctx->filtering) {
+                    return ngx_http_request_body_filter_wait(r);
+                }
+
+                rc = ngx_http_request_body_deliver(r, rb->buf);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
             clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
             /*对read事情加超时机制,这里应该会设置下面接下来的c->read->timer_set*/
             ngx_add_timer(c->read, clcf->client_body_timeout);
@@ -411,16 +1643,79 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         }
     }
 
+complete:
+
+    if (ctx->filtering) {
+        return ngx_http_request_body_filter_wait(r);
+    }
+
     if (c->read->timer_set) {
         /*删除超时*/
         ngx_del_timer(c->read);
     }
+
+    if (ctx->chunked_body) {
+        r->headers_in.content_length_n = ctx->received;
+        ngx_http_request_body_hist_add(r, ctx->received);
+    }
+
+    if (ctx->replaced) {
+        if (ngx_http_request_body_save_done(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_request_body_read_done(r);
+
+        r->read_event_handler = ngx_http_block_reading;
+        rb->post_handler(r);
+
+        return NGX_OK;
+    }
+
+    if (ctx->data_handler) {
+        rc = ngx_http_request_body_deliver(r, rb->buf);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        ngx_http_request_body_release(r);
+        ngx_http_request_body_read_done(r);
+
+        r->read_event_handler = ngx_http_block_reading;
+        rb->post_handler(r);
+
+        return NGX_OK;
+    }
      
     /*处理完上面的各种情况，终于可以写文件保存起来了*/
-    if (rb->temp_file || r->request_body_in_file_only) {
+    if (rb->temp_file || r->request_body_in_file_only || ctx->spill) {
 
         /* save the last part */
         /*写文件*/
+#if (NGX_THREADS)
+        if (ctx->thread_pool) {
+
+            if (!ctx->aio_last) {
+                rc = ngx_http_request_body_thread_write(r, rb->to_write);
+
+                if (rc == NGX_ERROR) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                if (rc == NGX_AGAIN) {
+                    return NGX_AGAIN;
+                }
+
+                ctx->aio_last = 1;
+            }
+
+            if (ctx->aio_busy) {
+                ngx_http_request_body_thread_wait(r);
+                return NGX_AGAIN;
+            }
+
+        } else
+#endif
         if (ngx_http_write_request_body(r, rb->to_write) != NGX_OK) {
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
@@ -434,13 +1729,26 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         b->file_pos = 0;
         b->file_last = rb->temp_file->file.offset;
         b->file = &rb->temp_file->file;
-        /*TODO:为何这里只可能有两个buf*/
-        if (rb->bufs->next) {
-            rb->bufs->next->buf = b;
+        /*
+         * the file buf replaces all the links that were written to the file,
+         * only the part preread in r->header_in may precede it
+         */
 
-        } else {
-            rb->bufs->buf = b;
+        cl = rb->bufs;
+
+        if (cl->next
+            && !r->request_body_in_file_only
+            && !r->request_body_in_single_buf)
+        {
+            cl = cl->next;
         }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        /* the body is in the file, the buffers are not needed anymore */
+
+        ngx_http_request_body_release(r);
     }
 
     if (rb->bufs->next
@@ -450,6 +1758,8 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         rb->bufs = rb->bufs->next;
     }
 
+    ngx_http_request_body_read_done(r);
+
     r->read_event_handler = ngx_http_block_reading;
     /*已读完了所有数据，可调用回调函数了*/
     rb->post_handler(r);
@@ -461,10 +1771,12 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_write_request_body(ngx_http_request_t *r, ngx_chain_t *body)
 {
-    ssize_t                    n;
-    ngx_temp_file_t           *tf;
-    ngx_http_request_body_t   *rb;
-    ngx_http_core_loc_conf_t  *clcf;
+    ssize_t                       n;
+    uint64_t                      usec;
+    ngx_temp_file_t              *tf;
+    ngx_http_request_body_t      *rb;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
 
     rb = r->request_body;
     /*temp_file未定义*/
@@ -494,19 +1806,58 @@ ngx_http_write_request_body(ngx_http_request_t *r, ngx_chain_t *body)
 
         rb->temp_file = tf;
 
+#if (NGX_LINUX)
+        /*小于client_body_memory_spool的body放到memfd里，不落盘*/
+        if (ngx_http_request_body_memfd_create(r, tf) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+#endif
+        /*创建temp文件，body为NULL时就返回了*/
+        if (tf->file.fd == NGX_INVALID_FILE
+            && ngx_http_request_body_spool_open(r, tf) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_O_DIRECT)
+        if (ngx_http_request_body_directio_init(r) != NGX_OK) {
+            return NGX_ERROR;
+        }
+#endif
+
+#if (NGX_HAVE_LZ4)
+        if (ngx_http_request_body_lz4_init(r) != NGX_OK) {
+            return NGX_ERROR;
+        }
+#endif
+
         if (body == NULL) {
             /* empty body with r->request_body_in_file_only */
-            /*创建temp文件，就返回了*/
-            if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
-                                     tf->persistent, tf->clean, tf->access)
-                != NGX_OK)
-            {
-                return NGX_ERROR;
-            }
-
             return NGX_OK;
         }
     }
+
+#if (NGX_LINUX)
+    if (ngx_http_request_body_memfd_check(r, body) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+#if (NGX_HAVE_O_DIRECT)
+    if (ngx_http_request_body_ctx(r)->directio) {
+        /*直接I/O模式，数据先攒到对齐的buf里，凑够一批再写*/
+        return ngx_http_request_body_directio_write(r, body);
+    }
+#endif
+
+#if (NGX_HAVE_LZ4)
+    if (ngx_http_request_body_ctx(r)->lz4) {
+        return ngx_http_request_body_lz4_write(r, body);
+    }
+#endif
+
+    usec = ngx_http_request_body_usec();
+
     /*如果rb->temp_file != NULL*/
     n = ngx_write_chain_to_temp_file(rb->temp_file, body);
 
@@ -518,216 +1869,5376 @@ ngx_http_write_request_body(ngx_http_request_t *r, ngx_chain_t *body)
     /*更新写文件偏移*/
     rb->temp_file->offset += n;
 
+    ctx = ngx_http_request_body_ctx(r);
+
+    ctx->spilled += n;
+    ctx->spill_usec += ngx_http_request_body_usec() - usec;
+
     return NGX_OK;
 }
 
-/*以下为忽略body之类的函数，暂时用不上所以暂不分析了：）*/
-ngx_int_t
-ngx_http_discard_request_body(ngx_http_request_t *r)
-{
-    ssize_t       size;
-    ngx_event_t  *rev;
 
-    if (r != r->main || r->discard_body) {
-        return NGX_OK;
-    }
+#if (NGX_HAVE_O_DIRECT)
 
-    if (ngx_http_test_expect(r) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+/*
+ * the direct writes bypass the page cache: the body is collected in an
+ * aligned buffer and written in batches of its size, only the tail that
+ * is not a multiple of the alignment is written through the cache
+ */
+
+static ngx_int_t
+ngx_http_request_body_directio_init(ngx_http_request_t *r)
+{
+    size_t                             size, alignment;
+    u_char                            *p;
+    ngx_buf_t                         *b;
+    ngx_http_core_loc_conf_t          *clcf;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    /* the other writers go to the file on their own */
+
+    if (rblcf->directio == 0
+#if (NGX_LINUX)
+        || ctx->memfd
+        || ngx_http_request_body_splice_enabled(r)
+#endif
+#if (NGX_THREADS)
+        || ctx->thread_pool
+#endif
+        || (r->headers_in.content_length_n >= 0
+            && r->headers_in.content_length_n < (off_t) rblcf->directio))
+    {
+        return NGX_OK;
     }
 
-    rev = r->connection->read;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0, "http set discard body");
+    alignment = clcf->directio_alignment;
+    size = (rblcf->directio + alignment - 1) / alignment * alignment;
 
-    if (rev->timer_set) {
-        ngx_del_timer(rev);
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
     }
 
-    if (r->headers_in.content_length_n <= 0 || r->request_body) {
-        return NGX_OK;
+    p = ngx_pmemalign(r->pool, size, alignment);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    size = r->header_in->last - r->header_in->pos;
+    b->start = p;
+    b->pos = p;
+    b->last = p;
+    b->end = p + size;
+    b->temporary = 1;
 
-    if (size) {
-        if (r->headers_in.content_length_n > size) {
-            r->header_in->pos += size;
-            r->headers_in.content_length_n -= size;
+    ctx->directio = b;
 
-        } else {
-            r->header_in->pos += (size_t) r->headers_in.content_length_n;
-            r->headers_in.content_length_n = 0;
-            return NGX_OK;
-        }
-    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body directio: %uz, alignment %uz",
+                   size, alignment);
 
-    if (ngx_http_read_discarded_request_body(r) == NGX_OK) {
-        r->lingering_close = 0;
-        return NGX_OK;
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_directio_write(ngx_http_request_t *r, ngx_chain_t *body)
+{
+    u_char                       *p;
+    size_t                        size, alignment;
+    ngx_buf_t                    *b;
+    ngx_chain_t                  *cl;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+    b = ctx->directio;
+
+    /* the buffers of the chain are reused by the caller and left as is */
+
+    for (cl = body; cl; cl = cl->next) {
+
+        for (p = cl->buf->pos; p < cl->buf->last; p += size) {
+            size = ngx_min(cl->buf->last - p, b->end - b->last);
+
+            b->last = ngx_cpymem(b->last, p, size);
+
+            if (b->last == b->end) {
+                if (ngx_http_request_body_directio_flush(r, b->end - b->pos, 1)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+        }
     }
 
-    /* == NGX_AGAIN */
+    if (r->request_body->rest) {
+        return NGX_OK;
+    }
 
-    r->read_event_handler = ngx_http_discarded_request_body_handler;
+    /* the last write, the temp file offset has to cover the whole body */
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    alignment = clcf->directio_alignment;
+
+    size = (b->last - b->pos) / alignment * alignment;
+
+    if (size
+        && ngx_http_request_body_directio_flush(r, size, 1) != NGX_OK)
+    {
+        return NGX_ERROR;
     }
 
-    r->count++;
-    r->discard_body = 1;
+    if (b->last > b->pos
+        && ngx_http_request_body_directio_flush(r, b->last - b->pos, 0)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_pfree(r->pool, b->start);
+    ctx->directio = NULL;
 
     return NGX_OK;
 }
 
 
-void
-ngx_http_discarded_request_body_handler(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_request_body_directio_flush(ngx_http_request_t *r, size_t size,
+    ngx_uint_t direct)
 {
-    ngx_int_t                  rc;
-    ngx_msec_t                 timer;
-    ngx_event_t               *rev;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+    ssize_t                       n;
+    uint64_t                      usec;
+    ngx_buf_t                    *b;
+    ngx_file_t                   *file;
+    ngx_temp_file_t              *tf;
+    ngx_http_request_body_ctx_t  *ctx;
 
-    c = r->connection;
-    rev = c->read;
+    ctx = ngx_http_request_body_ctx(r);
+    tf = r->request_body->temp_file;
+    file = &tf->file;
+    b = ctx->directio;
 
-    if (rev->timedout) {
-        c->timedout = 1;
-        c->error = 1;
-        ngx_http_finalize_request(r, NGX_ERROR);
-        return;
-    }
+    if (direct && !file->directio) {
 
-    if (r->lingering_time) {
-        timer = (ngx_msec_t) (r->lingering_time - ngx_time());
+        if (ngx_directio_on(file->fd) == NGX_FILE_ERROR) {
 
-        if (timer <= 0) {
-            r->discard_body = 0;
-            r->lingering_close = 0;
-            ngx_http_finalize_request(r, NGX_ERROR);
-            return;
+            /* tmpfs and the like, the batches go through the cache */
+
+            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, ngx_errno,
+                          ngx_directio_on_n " \"%V\" failed", &file->name);
+
+        } else {
+            file->directio = 1;
         }
 
-    } else {
-        timer = 0;
+    } else if (!direct && file->directio) {
+
+        if (ngx_directio_off(file->fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_directio_off_n " \"%V\" failed", &file->name);
+            return NGX_ERROR;
+        }
+
+        file->directio = 0;
     }
 
-    rc = ngx_http_read_discarded_request_body(r);
+    usec = ngx_http_request_body_usec();
 
-    if (rc == NGX_OK) {
-        r->discard_body = 0;
-        r->lingering_close = 0;
-        ngx_http_finalize_request(r, NGX_DONE);
-        return;
+    n = ngx_write_file(file, b->pos, size, tf->offset);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-    /* rc == NGX_AGAIN */
+    tf->offset += n;
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        c->error = 1;
-        ngx_http_finalize_request(r, NGX_ERROR);
-        return;
+    ctx->spilled += n;
+    ctx->spill_usec += ngx_http_request_body_usec() - usec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body directio write: %z of %uz%s",
+                   n, size, file->directio ? " direct" : "");
+
+    b->pos += size;
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
     }
 
-    if (timer) {
+    return NGX_OK;
+}
 
-        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
 
-        timer *= 1000;
 
-        if (timer > clcf->lingering_timeout) {
-            timer = clcf->lingering_timeout;
-        }
+#if (NGX_HAVE_LZ4)
 
-        ngx_add_timer(rev, timer);
+/*
+ * every buffer written to the temp file is compressed into an LZ4 block
+ * of its own; the index of the blocks is kept with the request, so the
+ * file can only be read with ngx_http_request_body_read_file() and
+ * ngx_http_request_body_map(), and is spooled so only for a consumer that
+ * has asked for it with ngx_http_read_compressed_request_body()
+ */
+
+static ngx_int_t
+ngx_http_request_body_lz4_init(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    /* a persistent file is left to others, the other writers go on their own */
+
+    if (!rblcf->lz4
+        || !ctx->compressed
+        || r->request_body->temp_file->persistent
+#if (NGX_LINUX)
+        || ctx->memfd
+        || ngx_http_request_body_splice_enabled(r)
+#endif
+#if (NGX_THREADS)
+        || ctx->thread_pool
+#endif
+#if (NGX_HAVE_O_DIRECT)
+        || ctx->directio
+#endif
+       )
+    {
+        return NGX_OK;
+    }
+
+    ctx->lz4 = ngx_array_create(r->pool, 8,
+                                sizeof(ngx_http_request_body_lz4_block_t));
+    if (ctx->lz4 == NULL) {
+        return NGX_ERROR;
     }
+
+    ctx->lz4_cached = (ngx_uint_t) -1;
+
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_read_discarded_request_body(ngx_http_request_t *r)
+ngx_http_request_body_lz4_write(ngx_http_request_t *r, ngx_chain_t *body)
 {
-    size_t   size;
-    ssize_t  n;
-    u_char   buffer[NGX_HTTP_DISCARD_BUFFER_SIZE];
+    int                                 n;
+    u_char                             *p;
+    size_t                              size, bound;
+    ssize_t                             written;
+    uint64_t                            usec;
+    ngx_chain_t                        *cl;
+    ngx_temp_file_t                    *tf;
+    ngx_http_request_body_ctx_t        *ctx;
+    ngx_http_request_body_lz4_stat_t   *st;
+    ngx_http_request_body_lz4_block_t  *blk;
+
+    ctx = ngx_http_request_body_ctx(r);
+    tf = r->request_body->temp_file;
+    st = &ngx_http_request_body_lz4_stat;
+
+    usec = ngx_http_request_body_usec();
+
+    for (cl = body; cl; cl = cl->next) {
+        size = cl->buf->last - cl->buf->pos;
+
+        if (size == 0) {
+            continue;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http read discarded body");
+        bound = LZ4_compressBound((int) size);
 
-    for ( ;; ) {
-        if (r->headers_in.content_length_n == 0) {
-            r->read_event_handler = ngx_http_block_reading;
-            return NGX_OK;
+        if (ngx_http_request_body_lz4_alloc(r, &ctx->lz4_buf, &ctx->lz4_size,
+                                            bound)
+            == NULL)
+        {
+            return NGX_ERROR;
         }
 
-        if (!r->connection->read->ready) {
-            return NGX_AGAIN;
+        n = LZ4_compress_default((char *) cl->buf->pos, (char *) ctx->lz4_buf,
+                                 (int) size, (int) bound);
+
+        /*
+         * the data that shrink by less than 1/8 are stored as is,
+         * a block is compressed if it is shorter than its data
+         */
+
+        if (n > 0 && (size_t) n < size - size / 8) {
+            p = ctx->lz4_buf;
+
+        } else {
+            p = cl->buf->pos;
+            n = (int) size;
+
+            st->stored++;
         }
 
-        size = (r->headers_in.content_length_n > NGX_HTTP_DISCARD_BUFFER_SIZE) ?
-                   NGX_HTTP_DISCARD_BUFFER_SIZE:
-                   (size_t) r->headers_in.content_length_n;
+        blk = ngx_array_push(ctx->lz4);
+        if (blk == NULL) {
+            return NGX_ERROR;
+        }
 
-        n = r->connection->recv(r->connection, buffer, size);
+        blk->start = ctx->lz4_length;
+        blk->offset = tf->file.offset;
+        blk->size = n;
+        blk->length = size;
 
-        if (n == NGX_ERROR) {
-            r->connection->error = 1;
-            return NGX_OK;
+        written = ngx_write_file(&tf->file, p, n, tf->file.offset);
+
+        if (written == NGX_ERROR) {
+            return NGX_ERROR;
         }
 
-        if (n == NGX_AGAIN) {
-            return NGX_AGAIN;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http client request body lz4 block: %uz of %uz at %O",
+                       (size_t) n, size, blk->offset);
+
+        tf->offset += written;
+        ctx->lz4_length += size;
+        ctx->spilled += written;
+
+        st->length += size;
+        st->written += written;
+        st->blocks++;
+    }
+
+    ctx->spill_usec += ngx_http_request_body_usec() - usec;
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_request_body_lz4_read(ngx_http_request_t *r, u_char *buf,
+    size_t size, off_t offset)
+{
+    int                                 n;
+    u_char                             *start;
+    size_t                              len, skip;
+    ngx_uint_t                          i, lo, hi;
+    ngx_file_t                          file;
+    ngx_http_request_body_ctx_t        *ctx;
+    ngx_http_request_body_lz4_block_t  *blocks, *blk;
+
+    ctx = ngx_http_request_body_ctx(r);
+    blocks = ctx->lz4->elts;
+
+    /* the first block that ends after the offset */
+
+    lo = 0;
+    hi = ctx->lz4->nelts;
+
+    while (lo < hi) {
+        i = lo + (hi - lo) / 2;
+
+        if (blocks[i].start + blocks[i].length <= offset) {
+            lo = i + 1;
+
+        } else {
+            hi = i;
         }
+    }
 
-        if (n == 0) {
-            return NGX_OK;
+    /* ngx_read_file() moves the offset the body length is taken from */
+
+    file = r->request_body->temp_file->file;
+    start = buf;
+
+    for (i = lo; i < ctx->lz4->nelts && size; i++) {
+        blk = &blocks[i];
+
+        skip = (size_t) (offset - blk->start);
+        len = ngx_min(size, blk->length - skip);
+
+        if (blk->size == blk->length) {
+
+            /* stored as is */
+
+            if (ngx_read_file(&file, buf, len, blk->offset + skip)
+                != (ssize_t) len)
+            {
+                goto failed;
+            }
+
+        } else {
+
+            if (ctx->lz4_cached != i) {
+                if (ngx_http_request_body_lz4_alloc(r, &ctx->lz4_buf,
+                                                    &ctx->lz4_size, blk->size)
+                    == NULL
+                    || ngx_http_request_body_lz4_alloc(r, &ctx->lz4_out,
+                                                       &ctx->lz4_out_size,
+                                                       blk->length)
+                       == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                ctx->lz4_cached = (ngx_uint_t) -1;
+
+                if (ngx_read_file(&file, ctx->lz4_buf, blk->size, blk->offset)
+                    != (ssize_t) blk->size)
+                {
+                    goto failed;
+                }
+
+                n = LZ4_decompress_safe((char *) ctx->lz4_buf,
+                                        (char *) ctx->lz4_out,
+                                        (int) blk->size, (int) blk->length);
+
+                if (n != (int) blk->length) {
+                    goto failed;
+                }
+
+                ctx->lz4_cached = i;
+            }
+
+            ngx_memcpy(buf, ctx->lz4_out + skip, len);
         }
 
-        r->headers_in.content_length_n -= n;
+        buf += len;
+        size -= len;
+        offset += len;
+    }
+
+    return buf - start;
+
+failed:
+
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "lz4 block %ui at %O of \"%V\" is damaged",
+                  i, blk->offset, &file.name);
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_request_body_lz4_alloc(ngx_http_request_t *r, u_char **p,
+    size_t *size, size_t need)
+{
+    if (*size >= need) {
+        return *p;
+    }
+
+    if (*p) {
+        ngx_pfree(r->pool, *p);
     }
+
+    *p = ngx_palloc(r->pool, need);
+    *size = *p ? need : 0;
+
+    return *p;
 }
 
-/*这里只是在判断有没有http 1.1的expect头并发送相应的回答*/
+#endif
+
+
+#if (NGX_THREADS)
+
 static ngx_int_t
-ngx_http_test_expect(ngx_http_request_t *r)
+ngx_http_request_body_thread_flush(ngx_http_request_t *r)
 {
-    ngx_int_t   n;
-    ngx_str_t  *expect;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_http_request_body_t      *rb;
+    ngx_http_request_body_ctx_t  *ctx;
 
-    if (r->expect_tested
-        || r->headers_in.expect == NULL
-        || r->http_version < NGX_HTTP_VERSION_11)
-    {
-        return NGX_OK;
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    rc = ngx_http_request_body_thread_write(r, rb->to_write);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
     }
 
-    r->expect_tested = 1;
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    expect = &r->headers_in.expect->value;
+    /*
+     * rb->buf is owned by the thread until the write is completed,
+     * so the reading continues into the spare buffer
+     */
 
-    if (expect->len != sizeof("100-continue") - 1
-        || ngx_strncasecmp(expect->data, (u_char *) "100-continue",
-                           sizeof("100-continue") - 1)
-           != 0)
-    {
-        return NGX_OK;
+    if (ctx->spare == NULL) {
+        ctx->spare = ngx_http_request_body_alloc_buf(r,
+                                                rb->buf->end - rb->buf->start);
+        if (ctx->spare == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "send 100 Continue");
+    b = rb->buf;
+    rb->buf = ctx->spare;
+    ctx->spare = b;
+
+    rb->buf->pos = rb->buf->start;
+    rb->buf->last = rb->buf->start;
+
+    rb->to_write = rb->bufs->next ? rb->bufs->next : rb->bufs;
+    rb->to_write->buf = rb->buf;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_thread_write(ngx_http_request_t *r, ngx_chain_t *body)
+{
+    ngx_chain_t                         *cl, **ll;
+    ngx_thread_task_t                   *task;
+    ngx_http_request_body_t             *rb;
+    ngx_http_request_body_ctx_t         *ctx;
+    ngx_http_request_body_thread_ctx_t  *tctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (ctx->aio_busy) {
+
+        /* the previous write is not completed yet */
+
+        ngx_http_request_body_thread_wait(r);
+        return NGX_AGAIN;
+    }
+
+    if (rb->temp_file == NULL) {
+        if (ngx_http_write_request_body(r, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_LINUX)
+    if (ctx->memfd) {
+
+        /* writes to the memory spool do not block */
 
-    n = r->connection->send(r->connection,
-                            (u_char *) "HTTP/1.1 100 Continue" CRLF CRLF,
-                            sizeof("HTTP/1.1 100 Continue" CRLF CRLF) - 1);
+        if (ngx_http_write_request_body(r, body) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    if (n == sizeof("HTTP/1.1 100 Continue" CRLF CRLF) - 1) {
         return NGX_OK;
     }
+#endif
 
-    /* we assume that such small packet should be send successfully */
+    task = ctx->task;
 
-    return NGX_ERROR;
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_request_body_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_http_request_body_thread_write_handler;
+        task->event.data = r;
+        task->event.handler = ngx_http_request_body_thread_event_handler;
+
+        ctx->task = task;
+    }
+
+    tctx = task->ctx;
+
+    tctx->file = &rb->temp_file->file;
+    tctx->offset = rb->temp_file->offset;
+    tctx->pool = r->pool;
+    tctx->written = 0;
+
+    /* the links are reused by the reader, so the thread gets its own ones */
+
+    ll = &tctx->chain;
+
+    for ( /* void */ ; body; body = body->next) {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = body->buf;
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = NULL;
+
+    if (ngx_thread_task_post(ctx->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body thread write at %O",
+                   tctx->offset);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    ctx->aio_busy = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_thread_write_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_request_body_thread_ctx_t *tctx = data;
+
+    uint64_t  usec;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http client request body thread write handler");
+
+    usec = ngx_http_request_body_usec();
+
+    tctx->written = ngx_write_chain_to_file(tctx->file, tctx->chain,
+                                            tctx->offset, tctx->pool);
+
+    tctx->usec = ngx_http_request_body_usec() - usec;
+}
+
+
+static void
+ngx_http_request_body_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_int_t                            rc;
+    ngx_chain_t                         *cl, *ln;
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r;
+    ngx_http_request_body_t             *rb;
+    ngx_http_request_body_ctx_t         *ctx;
+    ngx_http_request_body_thread_ctx_t  *tctx;
+
+    r = ev->data;
+    c = r->connection;
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    tctx = ctx->task->ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http client request body thread written %z",
+                   tctx->written);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx->aio_busy = 0;
+
+    for (cl = tctx->chain; cl; cl = ln) {
+        ln = cl->next;
+        ngx_free_chain(r->pool, cl);
+    }
+
+    tctx->chain = NULL;
+
+    if (tctx->written == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    rb->temp_file->offset += tctx->written;
+
+    ctx->spilled += tctx->written;
+    ctx->spill_usec += tctx->usec;
+
+    if (ctx->aio_waiting) {
+        ctx->aio_waiting = 0;
+
+        r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+        rc = ngx_http_do_read_client_request_body(r);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            ngx_http_finalize_request(r, rc);
+        }
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_request_body_thread_wait(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body waits for thread write");
+
+    /* the disk is the bottleneck now, so the client is not timed out */
+
+    if (r->connection->read->timer_set) {
+        ngx_del_timer(r->connection->read);
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+
+    ctx->aio_waiting = 1;
+}
+
+#endif
+
+
+#if (NGX_LINUX)
+
+static ngx_uint_t
+ngx_http_request_body_splice_enabled(ngx_http_request_t *r)
+{
+    ngx_uint_t                           i;
+    ngx_http_request_body_ctx_t         *ctx;
+    ngx_http_input_body_filter_used_pt  *used;
+    ngx_http_request_body_loc_conf_t    *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (!rblcf->splice
+        || !r->request_body_in_file_only
+        || ctx->chunked_body
+        || ctx->data_handler)
+    {
+        return 0;
+    }
+
+#if (NGX_SSL)
+    if (r->connection->ssl) {
+        return 0;
+    }
+#endif
+
+    /* the filters have to see the data, so those used disable splicing */
+
+    if (ngx_http_request_body_unchecked
+        || ngx_http_top_input_body_filter
+           != ngx_http_request_body_checked_filter)
+    {
+        return 0;
+    }
+
+    used = ngx_http_request_body_used->elts;
+
+    for (i = 0; i < ngx_http_request_body_used->nelts; i++) {
+        if (used[i](r)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_splice_init(ngx_http_request_t *r)
+{
+    int                           size;
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pipe2(ctx->pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "pipe2() failed");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_request_body_splice_cleanup;
+    cln->data = ctx;
+
+    /* let the pipe hold as much as a body buffer would */
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    size = fcntl(ctx->pipe[1], F_SETPIPE_SZ,
+                 (int) ngx_max(clcf->client_body_buffer_size, 65536));
+
+    if (size == -1) {
+        size = fcntl(ctx->pipe[1], F_GETPIPE_SZ);
+
+        if (size == -1) {
+            size = 65536;
+        }
+    }
+
+    ctx->pipe_size = size;
+    ctx->splice = 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body splice pipe %d:%d, size: %uz",
+                   ctx->pipe[0], ctx->pipe[1], ctx->pipe_size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_splice_cleanup(void *data)
+{
+    ngx_http_request_body_ctx_t *ctx = data;
+
+    if (close(ctx->pipe[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe read end failed");
+    }
+
+    if (close(ctx->pipe[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe write end failed");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_do_splice_client_request_body(ngx_http_request_t *r)
+{
+    off_t                         rest;
+    size_t                        size;
+    ssize_t                       n;
+    uint64_t                      usec;
+    loff_t                        offset;
+    ngx_err_t                     err;
+    ngx_buf_t                    *b;
+    ngx_temp_file_t              *tf;
+    ngx_connection_t             *c;
+    ngx_http_request_body_t      *rb;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    c = r->connection;
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    tf = rb->temp_file;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http splice client request body");
+
+    for ( ;; ) {
+
+        /* drain the pipe to the file */
+
+        if (ctx->piped) {
+            usec = ngx_http_request_body_usec();
+        }
+
+        while (ctx->piped) {
+            offset = tf->offset;
+
+            n = splice(ctx->pipe[0], NULL, tf->file.fd, &offset, ctx->piped,
+                       SPLICE_F_MOVE);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                ngx_log_error(NGX_LOG_CRIT, c->log, err,
+                              "splice() to \"%s\" failed",
+                              tf->file.name.data);
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (n == 0) {
+
+                /* the pipe has less than was spliced into it */
+
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "splice() to \"%s\" moved nothing, "
+                              "%uz bytes left in pipe",
+                              tf->file.name.data, ctx->piped);
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ctx->piped -= n;
+            tf->offset += n;
+            tf->file.offset += n;
+
+            ctx->spilled += n;
+
+            if (ctx->piped == 0) {
+                ctx->spill_usec += ngx_http_request_body_usec() - usec;
+            }
+        }
+
+        if (rb->rest == 0) {
+            break;
+        }
+
+        if (ngx_http_request_body_budget_spent(r)) {
+            ngx_http_request_body_yield(r);
+
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+            ngx_add_timer(c->read, clcf->client_body_timeout);
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        rest = rb->rest;
+        size = (rest > (off_t) ctx->pipe_size) ? ctx->pipe_size : (size_t) rest;
+
+        n = splice(c->fd, NULL, ctx->pipe[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http client request body splice %z", n);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_http_request_body_recv_stat(r, err == NGX_EAGAIN ? NGX_AGAIN
+                                                                 : NGX_ERROR);
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_INFO, c->log, err,
+                              "splice() from socket failed");
+                c->error = 1;
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            c->read->ready = 0;
+
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+            ngx_add_timer(c->read, clcf->client_body_timeout);
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "client prematurely closed connection");
+            c->error = 1;
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ngx_http_request_body_recv_stat(r, n);
+
+        rb->rest -= n;
+        r->request_length += n;
+        ctx->piped += n;
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->in_file = 1;
+    b->file_pos = 0;
+    b->file_last = tf->file.offset;
+    b->file = &tf->file;
+
+    if (rb->bufs == NULL) {
+        rb->bufs = ngx_alloc_chain_link(r->pool);
+        if (rb->bufs == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rb->bufs->buf = b;
+    rb->bufs->next = NULL;
+
+    ngx_http_request_body_read_done(r);
+
+    r->read_event_handler = ngx_http_block_reading;
+
+    rb->post_handler(r);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_memfd_create(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char                            *p;
+    ngx_fd_t                           fd;
+    ngx_pool_cleanup_t                *cln;
+    ngx_pool_cleanup_file_t           *clnf;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    /* a persistent file has to outlive the request, so it goes to disk */
+
+    if (rblcf->memory_spool == 0
+        || tf->persistent
+        || r->headers_in.content_length_n > (off_t) rblcf->memory_spool)
+    {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("/proc/self/fd/") - 1 + NGX_INT_T_LEN + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = memfd_create("client_body", MFD_CLOEXEC);
+
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      "memfd_create() failed, using the temp path");
+        return NGX_DECLINED;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name.data = p;
+    tf->file.name.len = ngx_sprintf(p, "/proc/self/fd/%d%Z", fd) - p - 1;
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = tf->file.name.data;
+    clnf->log = r->pool->log;
+
+    ctx->memfd = 1;
+    ctx->memfd_cleanup = cln;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body memfd: %d", fd);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_memfd_check(ngx_http_request_t *r, ngx_chain_t *body)
+{
+    off_t                              size;
+    u_char                            *map;
+    ssize_t                            n;
+    ngx_fd_t                           fd;
+    ngx_int_t                          rc;
+    ngx_chain_t                       *cl;
+    ngx_temp_file_t                   *tf;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (!ctx->memfd) {
+        return NGX_OK;
+    }
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    tf = r->request_body->temp_file;
+
+    size = tf->offset;
+
+    for (cl = body; cl; cl = cl->next) {
+        size += ngx_buf_size(cl->buf);
+    }
+
+    if (size <= (off_t) rblcf->memory_spool) {
+        return NGX_OK;
+    }
+
+    /* the body has outgrown the memory spool, move it to the temp path */
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body memfd overflow: %O+%O",
+                   tf->offset, size - tf->offset);
+
+    fd = tf->file.fd;
+    size = tf->offset;
+    map = NULL;
+
+    if (size) {
+        map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          "mmap(%O) of \"%V\" failed",
+                          size, &tf->file.name);
+            return NGX_ERROR;
+        }
+    }
+
+    tf->file.fd = NGX_INVALID_FILE;
+    tf->file.offset = 0;
+
+    rc = ngx_http_request_body_spool_open(r, tf);
+
+    if (rc == NGX_OK && size) {
+        n = ngx_write_file(&tf->file, map, (size_t) size, 0);
+
+        if (n != size) {
+            rc = NGX_ERROR;
+        }
+    }
+
+    if (map) {
+        if (munmap(map, (size_t) size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "munmap(%O) failed", size);
+        }
+    }
+
+    ctx->memfd_cleanup->handler(ctx->memfd_cleanup->data);
+    ctx->memfd_cleanup->handler = NULL;
+    ctx->memfd = 0;
+
+    return rc;
+}
+
+#endif
+
+
+/*
+ * creates the temp file for the body: an unnamed one, possibly reused,
+ * avoids the directory updates of a named file, which is unlinked right
+ * after the creation unless it is persistent anyway
+ */
+
+static ngx_int_t
+ngx_http_request_body_spool_open(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    ngx_int_t                          rc;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    rc = NGX_DECLINED;
+
+#if (NGX_LINUX) && defined O_TMPFILE
+    if (rblcf->tmpfile && !tf->persistent) {
+        rc = ngx_http_request_body_tmpfile(r, tf);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    if (rc == NGX_DECLINED
+        && ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                tf->persistent, tf->clean, tf->access)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#if (NGX_LINUX) && defined FALLOC_FL_KEEP_SIZE
+
+    /*
+     * the blocks for the whole body are reserved at once, the file size
+     * is not changed, so the file still reads as written
+     */
+
+    if (rblcf->preallocate && r->headers_in.content_length_n > 0) {
+
+        if (fallocate(tf->file.fd, FALLOC_FL_KEEP_SIZE, 0,
+                      r->headers_in.content_length_n)
+            == -1)
+        {
+            if (ngx_errno != NGX_EOPNOTSUPP) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                              "fallocate(%O) \"%V\" failed",
+                              r->headers_in.content_length_n,
+                              &tf->file.name);
+            }
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_LINUX) && defined O_TMPFILE
+
+static ngx_int_t
+ngx_http_request_body_tmpfile(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char                              *p;
+    ngx_fd_t                             fd;
+    ngx_err_t                            err;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_request_body_spool_t       *spool;
+    ngx_http_request_body_pool_stat_t   *st;
+    ngx_http_request_body_spool_file_t  *sf;
+    ngx_http_request_body_loc_conf_t    *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    st = &ngx_http_request_body_pool_stat;
+
+    for (spool = ngx_http_request_body_spools; spool; spool = spool->next) {
+        if (spool->path == tf->path) {
+            break;
+        }
+    }
+
+    if (spool == NULL && rblcf->spool_files) {
+        spool = ngx_palloc(ngx_cycle->pool,
+                           sizeof(ngx_http_request_body_spool_t));
+        if (spool == NULL) {
+            return NGX_ERROR;
+        }
+
+        spool->fds = ngx_palloc(ngx_cycle->pool,
+                                rblcf->spool_files * sizeof(ngx_fd_t));
+        if (spool->fds == NULL) {
+            return NGX_ERROR;
+        }
+
+        spool->path = tf->path;
+        spool->nfds = 0;
+        spool->max = rblcf->spool_files;
+
+        spool->next = ngx_http_request_body_spools;
+        ngx_http_request_body_spools = spool;
+    }
+
+    if ((spool == NULL || spool->nfds == 0)
+        && ngx_http_request_body_no_tmpfile)
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool,
+                               sizeof(ngx_http_request_body_spool_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("/proc/self/fd/") - 1 + NGX_INT_T_LEN + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (spool && spool->nfds) {
+        fd = spool->fds[--spool->nfds];
+        st->spool_hits++;
+
+    } else {
+        fd = open((char *) tf->path->name.data, O_TMPFILE|O_RDWR,
+                  tf->access ? tf->access : 0600);
+
+        if (fd == -1) {
+            err = ngx_errno;
+
+            /* the file system does not support unnamed files */
+
+            if (err == EISDIR || err == EOPNOTSUPP || err == EINVAL) {
+                ngx_log_error(NGX_LOG_NOTICE, r->connection->log, err,
+                              "open(O_TMPFILE) in \"%V\" failed, "
+                              "using named temp files", &tf->path->name);
+
+                ngx_http_request_body_no_tmpfile = 1;
+                return NGX_DECLINED;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          "open(O_TMPFILE) in \"%V\" failed",
+                          &tf->path->name);
+            return NGX_ERROR;
+        }
+
+        st->spool_opens++;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name.data = p;
+    tf->file.name.len = ngx_sprintf(p, "/proc/self/fd/%d%Z", fd) - p - 1;
+
+    cln->handler = ngx_http_request_body_spool_cleanup;
+    sf = cln->data;
+
+    sf->fd = fd;
+    sf->file = &tf->file;
+    sf->spool = spool;
+    sf->log = r->pool->log;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body tmpfile: %d", fd);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_spool_cleanup(void *data)
+{
+    ngx_http_request_body_spool_file_t *sf = data;
+
+    ngx_http_request_body_spool_t  *spool;
+
+    spool = sf->spool;
+
+#if (NGX_HAVE_O_DIRECT)
+
+    /* a body that was not read to the end leaves the flag set */
+
+    if (spool && sf->file->directio) {
+        if (ngx_directio_off(sf->fd) == NGX_FILE_ERROR) {
+            spool = NULL;
+
+        } else {
+            sf->file->directio = 0;
+        }
+    }
+
+#endif
+
+    if (spool && spool->nfds < spool->max) {
+
+        if (ftruncate(sf->fd, 0) == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sf->log, 0,
+                           "http client request body tmpfile keep: %d",
+                           sf->fd);
+
+            spool->fds[spool->nfds++] = sf->fd;
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, sf->log, ngx_errno,
+                      "ftruncate() tmpfile %d failed", sf->fd);
+    }
+
+    if (ngx_close_file(sf->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, sf->log, ngx_errno,
+                      ngx_close_file_n " tmpfile %d failed", sf->fd);
+    }
+}
+
+#endif
+
+
+/*
+ * the body of a request with an upload id is a part of an object spooled
+ * across requests to "<client_body_temp_path>/<id>.part": the part from
+ * "Content-Range: bytes start-end/total" is written at start, the part
+ * starting at 0 starts the object over, the "*" range with an empty body
+ * asks for the size already received.  The post handler is called
+ * once the object is complete, before that the request is answered with
+ * 308 and "Range: bytes=0-<last byte received>"
+ */
+
+static ngx_int_t
+ngx_http_request_body_resumable_init(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler)
+{
+    u_char                            *p;
+    ngx_fd_t                           fd;
+    ngx_err_t                          err;
+    ngx_int_t                          rc;
+    ngx_str_t                          id, name;
+    ngx_uint_t                         i;
+    ngx_queue_t                       *q;
+    ngx_file_info_t                    fi;
+    ngx_temp_file_t                   *tf;
+    ngx_pool_cleanup_t                *cln;
+    ngx_pool_cleanup_file_t           *clnf;
+    ngx_http_request_body_t           *rb;
+    ngx_http_core_loc_conf_t          *clcf;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_resume_t    *rs;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (ngx_http_complex_value(r, rblcf->resumable, &id) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (id.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    /* the id is used as a file name */
+
+    for (i = 0; i < id.len; i++) {
+        if (!((id.data[i] >= 'a' && id.data[i] <= 'z')
+              || (id.data[i] >= 'A' && id.data[i] <= 'Z')
+              || (id.data[i] >= '0' && id.data[i] <= '9')
+              || id.data[i] == '-' || id.data[i] == '_'))
+        {
+            break;
+        }
+    }
+
+    if (i != id.len || id.len > 64) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent invalid upload id \"%V\"", &id);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ctx->chunked_body) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent chunked part of upload \"%V\"", &id);
+        return NGX_HTTP_LENGTH_REQUIRED;
+    }
+
+    /*
+     * one request at a time appends to an object: the requests of this
+     * worker are found in the list, the other workers hold the lock
+     */
+
+    for (q = ngx_queue_head(&ngx_http_request_body_uploads);
+         q != ngx_queue_sentinel(&ngx_http_request_body_uploads);
+         q = ngx_queue_next(q))
+    {
+        rs = ngx_queue_data(q, ngx_http_request_body_resume_t, queue);
+
+        if (rs->id.len == id.len
+            && ngx_strncmp(rs->id.data, id.data, id.len) == 0)
+        {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "upload \"%V\" is in progress", &id);
+            return NGX_HTTP_CONFLICT;
+        }
+    }
+
+    rs = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_resume_t));
+    if (rs == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_request_body_content_range(r, rs);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_request_body_resumable_cleanup;
+    cln->data = rs;
+
+    rs->id = id;
+    ngx_queue_insert_tail(&ngx_http_request_body_uploads, &rs->queue);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    name.len = clcf->client_body_temp_path->name.len + 1 + id.len
+               + sizeof(".part") - 1;
+
+    name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(name.data, clcf->client_body_temp_path->name.data,
+                   clcf->client_body_temp_path->name.len);
+    *p++ = '/';
+    p = ngx_cpymem(p, id.data, id.len);
+    p = ngx_cpymem(p, ".part", sizeof(".part") - 1);
+    *p = '\0';
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(name.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN,
+                       r->request_body_file_group_access
+                       ? 0660 : NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name.data);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = name.data;
+    clnf->log = r->pool->log;
+
+    rs->cleanup = cln;
+
+    /*
+     * flock() belongs to the open file, unlike fcntl() locks it is not
+     * released when another request of the process closes the object
+     */
+
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "upload \"%V\" is in progress", &id);
+            return NGX_HTTP_CONFLICT;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      "flock(LOCK_EX|LOCK_NB) \"%s\" failed", name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name.data);
+        return NGX_ERROR;
+    }
+
+    rs->size = ngx_file_size(&fi);
+
+    if (rs->start == -1) {
+        rs->start = rs->size;
+
+    } else if (rs->start == 0 && rs->size) {
+        if (ftruncate(fd, 0) == -1) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          "ftruncate() \"%s\" failed", name.data);
+            return NGX_ERROR;
+        }
+
+        rs->size = 0;
+    }
+
+    if (rs->start > rs->size) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent part of upload \"%V\" at %O, "
+                      "only %O bytes received", &id, rs->start, rs->size);
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body upload \"%V\" at %O of %O, "
+                   "received %O", &id, rs->start, rs->total, rs->size);
+
+    tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+    if (tf == NULL) {
+        return NGX_ERROR;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name = name;
+    tf->file.log = r->connection->log;
+    tf->path = clcf->client_body_temp_path;
+    tf->pool = r->pool;
+    tf->log_level = r->request_body_file_log_level;
+
+    /* the file is closed or deleted by the cleanup above */
+    tf->persistent = 1;
+
+    tf->offset = rs->start;
+    tf->file.offset = rs->start;
+
+    rb->temp_file = tf;
+
+    rs->post_handler = post_handler;
+    ctx->resume = rs;
+
+    if (r->headers_in.content_length_n) {
+        r->request_body_in_file_only = 1;
+        r->request_body_in_single_buf = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_resumable_cleanup(void *data)
+{
+    ngx_http_request_body_resume_t  *rs = data;
+
+    ngx_queue_remove(&rs->queue);
+}
+
+
+static ngx_int_t
+ngx_http_request_body_content_range(ngx_http_request_t *r,
+    ngx_http_request_body_resume_t *rs)
+{
+    u_char           *p, *last, *dash, *slash;
+    off_t             end;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                h = NULL;
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("Content-Range") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Content-Range",
+                               sizeof("Content-Range") - 1)
+               == 0)
+        {
+            h = &h[i];
+            break;
+        }
+    }
+
+    if (h == NULL) {
+
+        /* the whole object in one request */
+
+        rs->start = 0;
+        rs->total = r->headers_in.content_length_n;
+
+        return NGX_OK;
+    }
+
+    p = h->value.data;
+    last = p + h->value.len;
+
+    if (h->value.len < sizeof("bytes */0") - 1
+        || ngx_strncasecmp(p, (u_char *) "bytes ", sizeof("bytes ") - 1) != 0)
+    {
+        goto invalid;
+    }
+
+    p += sizeof("bytes ") - 1;
+
+    slash = ngx_strlchr(p, last, '/');
+    if (slash == NULL) {
+        goto invalid;
+    }
+
+    if (slash + 2 == last && slash[1] == '*') {
+        rs->total = -1;
+
+    } else {
+        rs->total = ngx_atoof(slash + 1, last - slash - 1);
+        if (rs->total == NGX_ERROR) {
+            goto invalid;
+        }
+    }
+
+    if (slash - p == 1 && *p == '*') {
+
+        /* the size received is asked for */
+
+        if (r->headers_in.content_length_n != 0) {
+            goto invalid;
+        }
+
+        rs->start = -1;
+
+        return NGX_OK;
+    }
+
+    dash = ngx_strlchr(p, slash, '-');
+    if (dash == NULL) {
+        goto invalid;
+    }
+
+    rs->start = ngx_atoof(p, dash - p);
+    end = ngx_atoof(dash + 1, slash - dash - 1);
+
+    if (rs->start == NGX_ERROR
+        || end == NGX_ERROR
+        || end < rs->start
+        || (rs->total != -1 && end >= rs->total)
+        || end - rs->start + 1 != r->headers_in.content_length_n)
+    {
+        goto invalid;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent invalid \"Content-Range: %V\"", &h->value);
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+static void
+ngx_http_request_body_resumable_handler(ngx_http_request_t *r)
+{
+    off_t                            size;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl;
+    ngx_temp_file_t                 *tf;
+    ngx_http_request_body_t         *rb;
+    ngx_http_request_body_ctx_t     *ctx;
+    ngx_http_request_body_resume_t  *rs;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    rs = ctx->resume;
+    tf = rb->temp_file;
+
+    size = ngx_max(rs->size, tf->offset);
+
+    if (rs->total == -1 || size < rs->total) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http client request body upload incomplete: %O of %O",
+                       size, rs->total);
+
+        ngx_http_request_body_resumable_reply(r, size);
+        return;
+    }
+
+    /* a shorter object may have replaced a longer one */
+
+    if (size > rs->total && ftruncate(tf->file.fd, rs->total) == -1) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      "ftruncate() \"%V\" failed", &tf->file.name);
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body upload complete: %O", rs->total);
+
+    /* the body is the whole object now */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    b->in_file = 1;
+    b->file_pos = 0;
+    b->file_last = rs->total;
+    b->file = &tf->file;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    rb->bufs = cl;
+
+    tf->offset = rs->total;
+    tf->file.offset = rs->total;
+
+    r->headers_in.content_length_n = rs->total;
+
+    if (!r->request_body_in_persistent_file) {
+        rs->cleanup->handler = ngx_pool_delete_file;
+    }
+
+    rs->post_handler(r);
+}
+
+
+static void
+ngx_http_request_body_resumable_reply(ngx_http_request_t *r, off_t size)
+{
+    ngx_int_t         rc;
+    ngx_table_elt_t  *h;
+
+    r->headers_out.status = NGX_HTTP_REQUEST_BODY_RESUME_INCOMPLETE;
+    r->headers_out.content_length_n = 0;
+    r->header_only = 1;
+
+    if (size) {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        h->value.data = ngx_pnalloc(r->pool,
+                                    sizeof("bytes=0-") - 1 + NGX_OFF_T_LEN);
+        if (h->value.data == NULL) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        h->hash = 1;
+        ngx_str_set(&h->key, "Range");
+        h->value.len = ngx_sprintf(h->value.data, "bytes=0-%O", size - 1)
+                       - h->value.data;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK) {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
+}
+
+
+ngx_int_t
+ngx_http_request_body_map(ngx_http_request_t *r, ngx_str_t *body)
+{
+    off_t                         size;
+    u_char                       *p;
+    ngx_buf_t                    *b;
+    ngx_temp_file_t              *tf;
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_request_body_t      *rb;
+    ngx_http_request_body_map_t  *map;
+#if (NGX_HAVE_LZ4)
+    ngx_http_request_body_ctx_t  *ctx;
+#endif
+
+    rb = r->request_body;
+
+    if (rb == NULL || rb->rest || rb->temp_file == NULL) {
+        return NGX_DECLINED;
+    }
+
+    tf = rb->temp_file;
+
+    /*
+     * only a body that is all in the file is mapped, a part preread
+     * in memory before it would be missing from the mapping
+     */
+
+    if (rb->bufs == NULL || rb->bufs->next) {
+        return NGX_DECLINED;
+    }
+
+    b = rb->bufs->buf;
+
+    if (!b->in_file || b->file_pos != 0 || b->file_last != tf->file.offset) {
+        return NGX_DECLINED;
+    }
+
+    size = tf->file.offset;
+
+#if (NGX_HAVE_LZ4)
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (ctx->lz4) {
+        size = ctx->lz4_length;
+    }
+#endif
+
+    if (size == 0) {
+        ngx_str_null(body);
+        return NGX_OK;
+    }
+
+    if (size > (off_t) NGX_MAX_SIZE_T_VALUE) {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_request_body_map_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_LZ4)
+
+    if (ctx->lz4) {
+
+        /* the compressed body is decompressed to anonymous memory */
+
+        p = mmap(NULL, (size_t) size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANON, -1, 0);
+
+    } else
+#endif
+    {
+        p = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, tf->file.fd, 0);
+    }
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      "mmap(%O) of \"%V\" failed", size, &tf->file.name);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_request_body_unmap;
+    map = cln->data;
+
+    map->addr = p;
+    map->size = (size_t) size;
+    map->log = r->connection->log;
+
+#if (NGX_HAVE_LZ4)
+    if (ctx->lz4
+        && ngx_http_request_body_lz4_read(r, p, (size_t) size, 0) != size)
+    {
+        return NGX_ERROR;
+    }
+#endif
+
+    body->len = (size_t) size;
+    body->data = p;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_unmap(void *data)
+{
+    ngx_http_request_body_map_t *map = data;
+
+    if (munmap(map->addr, map->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, map->log, ngx_errno,
+                      "munmap(%uz) failed", map->size);
+    }
+}
+
+
+ssize_t
+ngx_http_request_body_read_file(ngx_http_request_t *r, u_char *buf,
+    size_t size, off_t offset)
+{
+    ngx_file_t                file;
+    ngx_http_request_body_t  *rb;
+
+    rb = r->request_body;
+
+    if (rb == NULL || rb->temp_file == NULL) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HAVE_LZ4)
+    if (ngx_http_request_body_ctx(r)->lz4) {
+        return ngx_http_request_body_lz4_read(r, buf, size, offset);
+    }
+#endif
+
+    /* the file offset is the length of the data written */
+
+    file = rb->temp_file->file;
+
+    return ngx_read_file(&file, buf, size, offset);
+}
+
+
+ngx_int_t
+ngx_http_request_body_contiguous(ngx_http_request_t *r, ngx_str_t *body)
+{
+    size_t                    size;
+    u_char                   *p;
+    ngx_buf_t                *b;
+    ngx_chain_t              *cl;
+    ngx_http_request_body_t  *rb;
+
+    rb = r->request_body;
+
+    if (rb == NULL || rb->rest) {
+        return NGX_DECLINED;
+    }
+
+    if (rb->bufs == NULL) {
+        ngx_str_null(body);
+        return NGX_OK;
+    }
+
+    size = 0;
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+
+        if (cl->buf->in_file) {
+
+            /* a part preread in memory may precede the file */
+
+            return ngx_http_request_body_map(r, body);
+        }
+
+        size += cl->buf->last - cl->buf->pos;
+    }
+
+    if (rb->bufs->next == NULL) {
+        body->len = size;
+        body->data = rb->bufs->buf->pos;
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body made contiguous: %uz", size);
+
+    b = ngx_create_temp_buf(r->pool, size ? size : 1);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+        p = cl->buf->pos;
+        b->last = ngx_cpymem(b->last, p, cl->buf->last - p);
+
+        ngx_http_request_body_free_buf(r, cl->buf);
+    }
+
+    /* the copy is kept, the next callers get it as is */
+
+    b->last_buf = 1;
+
+    rb->bufs->buf = b;
+    rb->bufs->next = NULL;
+    rb->buf = b;
+
+    body->len = size;
+    body->data = b->pos;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_request_body_view(ngx_http_request_t *r, ngx_str_t *parts,
+    ngx_uint_t *nparts)
+{
+    ngx_uint_t                n;
+    ngx_chain_t              *cl;
+    ngx_http_request_body_t  *rb;
+
+    rb = r->request_body;
+
+    if (rb == NULL || rb->rest) {
+        return NGX_DECLINED;
+    }
+
+    n = 0;
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+
+        if (cl->buf->in_file) {
+            return NGX_DECLINED;
+        }
+
+        if (cl->buf->last == cl->buf->pos) {
+            continue;
+        }
+
+        if (n == *nparts) {
+            return NGX_DECLINED;
+        }
+
+        parts[n].len = cl->buf->last - cl->buf->pos;
+        parts[n].data = cl->buf->pos;
+        n++;
+    }
+
+    *nparts = n;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_request_body_free(ngx_http_request_t *r)
+{
+    ngx_chain_t              *cl, **ll;
+    ngx_http_request_body_t  *rb;
+
+    rb = r->request_body;
+
+    if (rb == NULL || rb->rest) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body free");
+
+    /* the buffers in a file are kept, the file may be still sent */
+
+    ll = &rb->bufs;
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+
+        if (cl->buf->in_file) {
+            *ll = cl;
+            ll = &cl->next;
+            continue;
+        }
+
+        ngx_http_request_body_free_buf(r, cl->buf);
+    }
+
+    *ll = NULL;
+
+    ngx_http_request_body_release(r);
+}
+
+
+ngx_int_t
+ngx_http_request_body_replace(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (ctx->data_handler) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body replaced by filter");
+
+    ctx->replaced = 1;
+    ctx->last_out = &ctx->out;
+
+    return NGX_OK;
+}
+
+
+ngx_buf_t *
+ngx_http_request_body_get_buf(ngx_http_request_t *r, size_t size)
+{
+    return ngx_http_request_body_alloc_buf(r, size);
+}
+
+
+/*
+ * the saved buffers are kept in memory up to client_body_buffer_size,
+ * and in one buffer with r->request_body_in_single_buf, everything
+ * else goes to the temp file
+ */
+
+ngx_int_t
+ngx_http_request_body_save(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    size_t                        size;
+    ngx_chain_t                  *cl;
+    ngx_http_request_body_t      *rb;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    size = b->last - b->pos;
+
+    if (size == 0) {
+        ngx_http_request_body_free_buf(r, b);
+        return NGX_OK;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    ctx->out_size += size;
+    ctx->saved += size;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (rb->temp_file == NULL
+        && !r->request_body_in_file_only
+        && !ctx->spill
+        && ctx->out_size <= clcf->client_body_buffer_size
+        && !(r->request_body_in_single_buf && ctx->out->next))
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_write_request_body(r, ctx->out) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+        ngx_http_request_body_free_buf(r, cl->buf);
+    }
+
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
+    ctx->out_size = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_save_done(ngx_http_request_t *r)
+{
+    ngx_buf_t                    *b;
+    ngx_chain_t                  *cl;
+    ngx_http_request_body_t      *rb;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body saved %O", ctx->saved);
+
+    /* the length of what is stored rather than of what was received */
+
+    r->headers_in.content_length_n = ctx->saved;
+
+    ngx_http_request_body_release(r);
+
+    if (rb->temp_file == NULL && !r->request_body_in_file_only && !ctx->spill)
+    {
+        rb->bufs = ctx->out;
+        return NGX_OK;
+    }
+
+    if (ctx->out || rb->temp_file == NULL) {
+        if (ngx_http_write_request_body(r, ctx->out) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        for (cl = ctx->out; cl; cl = cl->next) {
+            ngx_http_request_body_free_buf(r, cl->buf);
+        }
+
+        ctx->out = NULL;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->in_file = 1;
+    b->file_pos = 0;
+    b->file_last = rb->temp_file->file.offset;
+    b->file = &rb->temp_file->file;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    rb->bufs = cl;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_call_filter(ngx_http_request_t *r, ngx_buf_t *in,
+    ngx_buf_t *b)
+{
+    ngx_int_t                     rc;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    b->last_buf = (r->request_body->rest == 0);
+
+    rc = ngx_http_top_input_body_filter(r, b);
+
+    if (rc == NGX_OK) {
+        ctx->filter_sync = 1;
+    }
+
+    if (rc == NGX_OK && ctx->replaced) {
+
+        /* the filter has taken what it needs, the space is reused */
+
+        in->last = b->start;
+    }
+
+    if (rc == NGX_AGAIN) {
+
+        /*
+         * a filter has handed the part to a task, the space stays
+         * in use until ngx_http_request_body_filter_done()
+         */
+
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        if (rc > NGX_OK && rc < NGX_HTTP_SPECIAL_RESPONSE) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "input filter: return code 1xx or 2xx "
+                          "will cause trouble and is converted to 500");
+        }
+
+        if (rc < NGX_HTTP_SPECIAL_RESPONSE) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return rc;
+}
+
+
+ngx_http_request_body_part_t *
+ngx_http_request_body_filter_async(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_http_input_body_filter_pt next)
+{
+    ngx_queue_t                   *q;
+    ngx_http_request_body_ctx_t   *ctx;
+    ngx_http_request_body_part_t  *part;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    part = ctx->handoff;
+
+    if (part && part->done) {
+
+        /* the part being passed on is taken over by the next task */
+
+        part->done = 0;
+
+    } else {
+
+        if (!ngx_queue_empty(&ctx->free_parts)) {
+            q = ngx_queue_head(&ctx->free_parts);
+            ngx_queue_remove(q);
+
+            part = ngx_queue_data(q, ngx_http_request_body_part_t, queue);
+
+        } else {
+            part = ngx_palloc(r->pool, sizeof(ngx_http_request_body_part_t));
+            if (part == NULL) {
+                return NULL;
+            }
+        }
+
+        part->done = 0;
+
+        if (ctx->handoff) {
+
+            /* a part being passed on was split, the rest follows it */
+
+            ngx_queue_insert_after(ctx->handoff_last, &part->queue);
+            ctx->handoff_last = &part->queue;
+
+        } else {
+            ngx_queue_insert_tail(&ctx->parts, &part->queue);
+        }
+
+        ngx_http_request_body_filter_hold(r);
+    }
+
+    part->buf = *b;
+    part->next = next;
+    part->rc = NGX_OK;
+
+    return part;
+}
+
+
+static void
+ngx_http_request_body_filter_hold(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    /* the request is not freed while the tasks use its buffers */
+
+    r->main->blocked++;
+
+    ctx->filter_async = 1;
+    ctx->filtering++;
+    ngx_http_request_body_read_stat.filtered++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body filtering %ui", ctx->filtering);
+
+    if (ctx->filtering >= rblcf->filter_inflight) {
+        ctx->filter_wait = 1;
+        ngx_http_request_body_read_stat.filter_waits++;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_request_body_filter_wait(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body waits for %ui filtered parts",
+                   ctx->filtering);
+
+    if (!ctx->filter_wait) {
+        ctx->filter_wait = 1;
+        ngx_http_request_body_read_stat.filter_waits++;
+    }
+
+    if (r->connection->read->timer_set) {
+        ngx_del_timer(r->connection->read);
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_http_request_body_filter_done(ngx_http_request_t *r,
+    ngx_http_request_body_part_t *part, ngx_int_t rc)
+{
+    ngx_buf_t                         *b;
+    ngx_uint_t                         i;
+    ngx_queue_t                       *q, *next;
+    ngx_http_request_body_t           *rb;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (rb == NULL || ctx->filtering == 0 || part->done) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "request body filter done without a part filtered");
+        return;
+    }
+
+    part->done = 1;
+    part->rc = rc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body filter done: %i, filtering %ui",
+                   rc, ctx->filtering);
+
+    if (r->connection->error) {
+
+        /*
+         * the request is being terminated, nothing is passed on,
+         * it is closed after the tasks
+         */
+
+        for (q = ngx_queue_head(&ctx->parts);
+             q != ngx_queue_sentinel(&ctx->parts);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+            part = ngx_queue_data(q, ngx_http_request_body_part_t, queue);
+
+            if (part->done) {
+                ngx_queue_remove(q);
+                ngx_queue_insert_tail(&ctx->free_parts, q);
+
+                r->main->blocked--;
+                ctx->filtering--;
+            }
+        }
+
+        if (r->main->blocked == 0 && r->write_event_handler) {
+            r->write_event_handler(r);
+        }
+
+        return;
+    }
+
+    ngx_http_request_body_filter_pass(r);
+
+    if (ctx->filtering) {
+
+        /*
+         * reading goes on below client_body_filter_inflight parts,
+         * it waits again if it needs the space held
+         */
+
+        if (ctx->filter_rc
+            || ctx->filter_preread
+            || ctx->filtering >= rblcf->filter_inflight)
+        {
+            return;
+        }
+
+    } else {
+
+        if (ctx->filter_rc) {
+            ngx_http_finalize_request(r, ctx->filter_rc);
+            return;
+        }
+
+        if (ctx->replaced) {
+
+            /* the filters have taken what they held, the space is reused */
+
+            if (ctx->readv) {
+                for (i = 0; i < ctx->nlinks; i++) {
+                    b = ctx->links[i].buf;
+                    b->last = b->pos;
+                }
+
+                ctx->current = 0;
+
+            } else {
+                rb->buf->last = rb->buf->pos;
+            }
+        }
+    }
+
+    if (!ctx->filter_wait) {
+        return;
+    }
+
+    ctx->filter_wait = 0;
+
+    if (ctx->paused || ctx->blocked || ctx->done || rb->post_handler == NULL) {
+        return;
+    }
+
+    if (ctx->filter_preread) {
+        ctx->filter_preread = 0;
+
+        rc = ngx_http_request_body_preread_done(r);
+
+    } else {
+        r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+        rc = ngx_http_do_read_client_request_body(r);
+    }
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+/*
+ * the parts are passed on in the order they were received: a part done
+ * before the ones ahead of it waits for them
+ */
+
+static void
+ngx_http_request_body_filter_pass(ngx_http_request_t *r)
+{
+    ngx_int_t                      rc;
+    ngx_queue_t                   *q;
+    ngx_http_request_body_ctx_t   *ctx;
+    ngx_http_request_body_part_t  *part;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    while (!ngx_queue_empty(&ctx->parts)) {
+
+        q = ngx_queue_head(&ctx->parts);
+        part = ngx_queue_data(q, ngx_http_request_body_part_t, queue);
+
+        if (!part->done) {
+            break;
+        }
+
+        rc = part->rc;
+
+        if (rc == NGX_OK && ctx->filter_rc == 0) {
+            ctx->handoff = part;
+            ctx->handoff_last = q;
+
+            rc = part->next(r, &part->buf);
+
+            ctx->handoff = NULL;
+
+            if (rc == NGX_AGAIN) {
+
+                if (!part->done) {
+
+                    /* the next filter has handed the part to its task */
+
+                    break;
+                }
+
+                /* the rest of the part split is held after it */
+
+                rc = NGX_OK;
+            }
+        }
+
+        if (rc != NGX_OK && ctx->filter_rc == 0) {
+            if (rc > NGX_OK && rc < NGX_HTTP_SPECIAL_RESPONSE) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "input filter: return code 1xx or 2xx "
+                              "will cause trouble and is converted to 500");
+            }
+
+            if (rc < NGX_HTTP_SPECIAL_RESPONSE) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            /* reading stops, the error is reported once the tasks are done */
+
+            ctx->filter_rc = rc;
+            ctx->filter_wait = 1;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&ctx->free_parts, q);
+
+        r->main->blocked--;
+        ctx->filtering--;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_request_body_readv_enabled(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    ctx = ngx_http_request_body_ctx(r);
+
+    /*
+     * a single buffer body and a data handler need one buffer only,
+     * a body to spill is read through one buffer too
+     */
+
+    if (rblcf->bufs.num == 0
+        || ctx->data_handler
+        || ctx->spill
+        || r->request_body_in_single_buf)
+    {
+        return 0;
+    }
+
+#if (NGX_THREADS)
+    if (ctx->thread_pool) {
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+
+static ngx_chain_t *
+ngx_http_request_body_readv_init(ngx_http_request_t *r)
+{
+    ngx_http_request_body_t           *rb;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    ctx->links = ngx_pcalloc(r->pool, rblcf->bufs.num * sizeof(ngx_chain_t));
+    if (ctx->links == NULL) {
+        return NULL;
+    }
+
+    ctx->recv = ngx_palloc(r->pool, rblcf->bufs.num * sizeof(ngx_chain_t));
+    if (ctx->recv == NULL) {
+        return NULL;
+    }
+
+    rb->buf = ngx_http_request_body_readv_alloc(r, rb->rest);
+    if (rb->buf == NULL) {
+        return NULL;
+    }
+
+    ctx->links[0].buf = rb->buf;
+    ctx->nlinks = 1;
+    ctx->current = 0;
+    ctx->readv = 1;
+
+    return &ctx->links[0];
+}
+
+
+static ngx_buf_t *
+ngx_http_request_body_readv_alloc(ngx_http_request_t *r, off_t rest)
+{
+    size_t                             size;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+    ctx = ngx_http_request_body_ctx(r);
+
+    size = rblcf->bufs.size;
+
+    /* the rest of a chunked body is only the minimum still expected */
+
+    if (!ctx->chunked_body && rest < (off_t) size) {
+        size = (size_t) rest;
+    }
+
+    return ngx_http_request_body_alloc_buf(r, size);
+}
+
+
+/*
+ * the body is received into up to client_body_buffers buffers at once,
+ * the buffers are written to the temp file with one writev() when all
+ * of them are full, so a body that fits in the buffers stays in memory
+ */
+
+static ngx_int_t
+ngx_http_do_readv_client_request_body(ngx_http_request_t *r)
+{
+    off_t                              limit;
+    u_char                            *last;
+    size_t                             size;
+    ssize_t                            n;
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b, buf;
+    ngx_uint_t                         i, num, async;
+    ngx_chain_t                       *in, **ll;
+    ngx_connection_t                  *c;
+    ngx_http_request_body_t           *rb;
+    ngx_http_core_loc_conf_t          *clcf;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    c = r->connection;
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    /* a spilled body is read on through the first buffer */
+
+    num = ctx->spilled_buffers ? 1 : (ngx_uint_t) rblcf->bufs.num;
+
+    for ( ;; ) {
+
+        /* the buffer of a link is allocated once a read reaches it */
+
+        b = ctx->links[ctx->current].buf;
+
+        if (b && b->last == b->end) {
+
+            if (ctx->current + 1 < num) {
+                ctx->current++;
+                continue;
+            }
+
+            /* all the buffers are full */
+
+            if (ctx->filtering) {
+                return ngx_http_request_body_filter_wait(r);
+            }
+
+            if (ngx_http_write_request_body(r, rb->to_write) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            rb->to_write = &ctx->links[0];
+
+            for (i = 0; i < ctx->nlinks; i++) {
+                b = ctx->links[i].buf;
+                b->pos = b->start;
+                b->last = b->start;
+            }
+
+            ctx->links[0].next = NULL;
+            ctx->nlinks = 1;
+            ctx->current = 0;
+
+            continue;
+        }
+
+        /*
+         * the free space of the buffers from the current one up to rb->rest;
+         * until the filters are seen to finish a part at once, and since
+         * one of them has kept a part for a task, a read fills no more
+         * buffers than the parts the filters may still hold
+         */
+
+        async = ctx->filter_async || !ctx->filter_sync;
+
+        limit = 0;
+        ll = &in;
+
+        for (i = ctx->current;
+             i < num
+             && (!async
+                 || i == ctx->current
+                 || ctx->filtering + (i - ctx->current)
+                    < rblcf->filter_inflight)
+             && limit < rb->rest;
+             i++)
+        {
+            if (ctx->links[i].buf == NULL) {
+                ctx->links[i].buf = ngx_http_request_body_readv_alloc(r,
+                                                           rb->rest - limit);
+                if (ctx->links[i].buf == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+            }
+
+            b = ctx->links[i].buf;
+
+            ctx->recv[i].buf = b;
+            *ll = &ctx->recv[i];
+            ll = &ctx->recv[i].next;
+
+            limit += b->end - b->last;
+        }
+
+        *ll = NULL;
+
+        if (limit > rb->rest) {
+            limit = rb->rest;
+        }
+
+        n = c->recv_chain(c, in, limit);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http client request body readv %z of %O", n, limit);
+
+        ngx_http_request_body_recv_stat(r, n);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "client prematurely closed connection");
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            c->error = 1;
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        r->request_length += n;
+
+        /* the data went to the buffers in order, pass them to the filters */
+
+        for (i = ctx->current; n; i++) {
+            b = ctx->links[i].buf;
+
+            size = b->end - b->last;
+            if (size > (size_t) n) {
+                size = (size_t) n;
+            }
+
+            n -= size;
+
+            if (i == ctx->nlinks) {
+                ctx->links[i - 1].next = &ctx->links[i];
+                ctx->links[i].next = NULL;
+                ctx->nlinks++;
+            }
+
+            ctx->current = i;
+
+            ngx_memzero(&buf, sizeof(ngx_buf_t));
+            buf.memory = 1;
+            buf.start = b->last;
+            buf.pos = b->last;
+            buf.last = b->last + size;
+            buf.end = buf.last;
+
+            if (ctx->chunked_body) {
+
+                /*
+                 * the chunks are decoded within the buffer, so the space
+                 * freed by the chunk headers at its end stays unused
+                 */
+
+                last = b->last;
+
+                rc = ngx_http_request_body_chunked(r, &buf, &last);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                buf.pos = buf.start;
+                buf.last = last;
+                buf.end = last;
+
+                b->last = last;
+
+            } else {
+                b->last += size;
+                rb->rest -= size;
+            }
+
+            rc = ngx_http_request_body_call_filter(r, b, &buf);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http client request body rest %O, links: %ui",
+                       rb->rest, ctx->nlinks);
+
+        if (ctx->blocked || ctx->filter_wait) {
+
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
+            r->read_event_handler = ngx_http_block_reading;
+            return NGX_AGAIN;
+        }
+
+        if (rb->rest == 0) {
+            return NGX_OK;
+        }
+
+        if (!c->read->ready) {
+            break;
+        }
+
+        if (ngx_http_request_body_budget_spent(r)) {
+            ngx_http_request_body_yield(r);
+            break;
+        }
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_add_timer(c->read, clcf->client_body_timeout);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_deliver(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t                     rc;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    /* an empty buffer is passed only to carry last_buf */
+
+    if (b->pos == b->last && ctx->rb.rest) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body deliver %uz",
+                   (size_t) (b->last - b->pos));
+
+    ngx_memzero(&ctx->data_buf, sizeof(ngx_buf_t));
+    ctx->data_buf.memory = 1;
+    ctx->data_buf.start = b->pos;
+    ctx->data_buf.pos = b->pos;
+    ctx->data_buf.last = b->last;
+    ctx->data_buf.end = b->last;
+    ctx->data_buf.last_buf = (ctx->rb.rest == 0);
+
+    rc = ctx->data_handler(r, &ctx->data_buf);
+
+    if (rc == NGX_OK) {
+        ngx_http_request_body_consumed(r, b);
+        return NGX_OK;
+    }
+
+    if (rc == NGX_AGAIN) {
+
+        /* the consumer is busy, stop reading until it is drained */
+
+        ctx->paused = 1;
+        ctx->pending = b;
+
+        if (r->connection->read->timer_set) {
+            ngx_del_timer(r->connection->read);
+        }
+
+        r->read_event_handler = ngx_http_block_reading;
+
+        return NGX_AGAIN;
+    }
+
+    if (rc > NGX_OK && rc < NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "body data handler: return code 1xx or 2xx "
+                      "will cause trouble and is converted to 500");
+    }
+
+    if (rc < NGX_HTTP_SPECIAL_RESPONSE) {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_request_body_consumed(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    if (b == r->request_body->buf) {
+        b->pos = b->start;
+        b->last = b->start;
+
+    } else {
+        b->pos = b->last;
+    }
+}
+
+
+void
+ngx_http_resume_client_request_body(ngx_http_request_t *r)
+{
+    ngx_int_t                     rc;
+    ngx_http_request_body_t      *rb;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (rb == NULL || !ctx->paused) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body resume");
+
+    ngx_http_request_body_consumed(r, ctx->pending);
+
+    ctx->paused = 0;
+    ctx->pending = NULL;
+
+    if (ctx->blocked) {
+
+        /* reading is continued by ngx_http_request_body_unblock() */
+
+        return;
+    }
+
+    if (rb->rest == 0) {
+        ngx_http_request_body_release(r);
+        ngx_http_request_body_read_done(r);
+
+        r->read_event_handler = ngx_http_block_reading;
+        rb->post_handler(r);
+        return;
+    }
+
+    r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+    rc = ngx_http_do_read_client_request_body(r);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+void
+ngx_http_request_body_block(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (r->request_body == NULL || ctx->done) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body block");
+
+    ctx->blocked = 1;
+}
+
+
+void
+ngx_http_request_body_unblock(ngx_http_request_t *r)
+{
+    ngx_int_t                     rc;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (r->request_body == NULL || !ctx->blocked) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body unblock");
+
+    ctx->blocked = 0;
+
+    if (ctx->paused || ctx->done || ctx->rb.post_handler == NULL) {
+        return;
+    }
+
+    r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+    rc = ngx_http_do_read_client_request_body(r);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+static ngx_buf_t *
+ngx_http_request_body_alloc_buf(ngx_http_request_t *r, size_t size)
+{
+    u_char                             *p;
+    size_t                              n;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_request_body_class_t      *cls;
+    ngx_http_request_body_pooled_t     *pb;
+    ngx_http_request_body_pool_stat_t  *st;
+    ngx_http_request_body_loc_conf_t   *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (!rblcf->buffer_pool
+        && !rblcf->memory_budget
+        && ngx_http_request_body_shared == NULL)
+    {
+        /* a large buffer is given back by ngx_pfree() when it is freed */
+
+        b = ngx_create_temp_buf(r->pool, size);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_request_body_module;
+
+        return b;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_request_body_pooled_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    for (i = 0, n = 1 << NGX_HTTP_REQUEST_BODY_POOL_SHIFT;
+         i < NGX_HTTP_REQUEST_BODY_POOL_CLASSES && n < size;
+         i++, n <<= 1)
+    {
+        /* void */
+    }
+
+    /* without the pool the buffers are only accounted */
+
+    if (i == NGX_HTTP_REQUEST_BODY_POOL_CLASSES || !rblcf->buffer_pool) {
+        i = NGX_HTTP_REQUEST_BODY_POOL_CLASSES;
+        n = size;
+    }
+
+    st = &ngx_http_request_body_pool_stat;
+    cls = &ngx_http_request_body_classes[i];
+
+    if (i < NGX_HTTP_REQUEST_BODY_POOL_CLASSES && cls->free) {
+        p = (u_char *) cls->free;
+        cls->free = cls->free->next;
+        cls->nfree--;
+
+        st->hits++;
+
+    } else {
+        p = ngx_alloc(n, r->connection->log);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        st->misses++;
+    }
+
+    if (++st->busy > st->busy_max) {
+        st->busy_max = st->busy;
+    }
+
+    st->busy_size += n;
+
+    if (ngx_http_request_body_shared) {
+        (void) ngx_atomic_fetch_add(ngx_http_request_body_shared, n);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body buffer get: %p %uz:%uz",
+                   p, size, n);
+
+    pb = cln->data;
+    pb->start = p;
+    pb->size = n;
+    pb->class = i;
+    pb->held = NULL;
+
+    if (r->request_body) {
+        pb->held = &ngx_http_request_body_ctx(r)->held;
+        *pb->held += n;
+    }
+
+    cln->handler = ngx_http_request_body_pool_cleanup;
+
+    b->start = p;
+    b->pos = p;
+    b->last = p;
+    b->end = p + size;
+    b->temporary = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_http_request_body_module;
+
+    return b;
+}
+
+
+static void
+ngx_http_request_body_free_buf(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_pool_cleanup_t              *c;
+    ngx_http_request_body_pooled_t  *pb;
+
+    if (b == NULL
+        || b->start == NULL
+        || b->tag != (ngx_buf_tag_t) &ngx_http_request_body_module)
+    {
+        return;
+    }
+
+    for (c = r->pool->cleanup; c; c = c->next) {
+        if (c->handler != ngx_http_request_body_pool_cleanup) {
+            continue;
+        }
+
+        pb = c->data;
+
+        if (pb->start == b->start) {
+            c->handler(pb);
+            c->handler = NULL;
+            break;
+        }
+    }
+
+    if (c == NULL) {
+        /* allocated from r->pool, only a large allocation can be freed */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http client request body buffer pfree: %p", b->start);
+
+        (void) ngx_pfree(r->pool, b->start);
+    }
+
+    b->start = NULL;
+    b->pos = NULL;
+    b->last = NULL;
+    b->end = NULL;
+}
+
+
+static void
+ngx_http_request_body_pool_cleanup(void *data)
+{
+    ngx_http_request_body_pooled_t *pb = data;
+
+    ngx_http_request_body_free_t       *f;
+    ngx_http_request_body_class_t      *cls;
+    ngx_http_request_body_pool_stat_t  *st;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http client request body buffer free: %p", pb->start);
+
+    st = &ngx_http_request_body_pool_stat;
+
+    st->busy--;
+    st->busy_size -= pb->size;
+
+    if (ngx_http_request_body_shared) {
+        (void) ngx_atomic_fetch_add(ngx_http_request_body_shared,
+                                    -(ngx_atomic_int_t) pb->size);
+    }
+
+    if (pb->held) {
+        *pb->held -= pb->size;
+    }
+
+    if (pb->class < NGX_HTTP_REQUEST_BODY_POOL_CLASSES) {
+        cls = &ngx_http_request_body_classes[pb->class];
+
+        if (cls->nfree < NGX_HTTP_REQUEST_BODY_POOL_FREE) {
+            f = (ngx_http_request_body_free_t *) pb->start;
+            f->next = cls->free;
+            cls->free = f;
+            cls->nfree++;
+            return;
+        }
+    }
+
+    ngx_free(pb->start);
+}
+
+
+/*
+ * returns the body buffers to the pool as soon as their content was written
+ * to the temp file or consumed by the data handler, rather than keeping
+ * them until the request is finalized
+ */
+
+static void
+ngx_http_request_body_release(ngx_http_request_t *r)
+{
+    ngx_uint_t                         i;
+    ngx_http_request_body_t           *rb;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (ctx->links) {
+        rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+        for (i = 0; i < (ngx_uint_t) rblcf->bufs.num; i++) {
+            ngx_http_request_body_free_buf(r, ctx->links[i].buf);
+        }
+
+        rb->buf = NULL;
+    }
+
+    if (rb->buf && rb->buf->tag == (ngx_buf_tag_t) &ngx_http_request_body_module)
+    {
+        ngx_http_request_body_free_buf(r, rb->buf);
+        rb->buf = NULL;
+    }
+
+#if (NGX_THREADS)
+    if (ctx->spare) {
+        ngx_http_request_body_free_buf(r, ctx->spare);
+        ctx->spare = NULL;
+    }
+#endif
+}
+
+
+static size_t
+ngx_http_request_body_memory_held(ngx_http_request_t *r)
+{
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (rblcf->memory_shared && ngx_http_request_body_shared) {
+        return (size_t) *ngx_http_request_body_shared;
+    }
+
+    return ngx_http_request_body_pool_stat.busy_size;
+}
+
+
+/*
+ * when the buffers of the bodies exceed the budget, either the new body
+ * or the largest of the bodies being read to memory is spilled to a temp
+ * file once it is complete, so its buffers are released without waiting
+ * for the request to finish
+ */
+
+static void
+ngx_http_request_body_memory_check(ngx_http_request_t *r, size_t size)
+{
+    ngx_queue_t                       *q;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_request_body_ctx_t       *ctx, *c, *largest;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (ngx_http_request_body_memory_held(r) + size > rblcf->memory_budget) {
+
+        largest = NULL;
+
+        for (q = ngx_queue_head(&ngx_http_request_body_inflight);
+             q != ngx_queue_sentinel(&ngx_http_request_body_inflight);
+             q = ngx_queue_next(q))
+        {
+            c = ngx_queue_data(q, ngx_http_request_body_ctx_t, queue);
+
+            if (c->rb.temp_file == NULL
+                && !c->spill
+                && (largest == NULL || c->held > largest->held))
+            {
+                largest = c;
+            }
+        }
+
+        ngx_http_request_body_pool_stat.forced++;
+
+        if (largest == NULL || largest->held <= size) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http client request body spilled: %uz over %uz",
+                           size, rblcf->memory_budget);
+
+            ctx->spill = 1;
+            return;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http client request body spilled another: %uz, %uz",
+                       largest->held, size);
+
+        largest->spill = 1;
+        largest->queued = 0;
+        ngx_queue_remove(&largest->queue);
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ctx->spill = 1;
+        return;
+    }
+
+    cln->handler = ngx_http_request_body_memory_cleanup;
+    cln->data = ctx;
+
+    ngx_queue_insert_tail(&ngx_http_request_body_inflight, &ctx->queue);
+    ctx->queued = 1;
+}
+
+
+/*
+ * a body picked to spill by another request writes out what it has read
+ * at its next read, and reads the rest through one buffer no larger than
+ * client_body_buffer_size written to the temp file as it fills
+ */
+
+static ngx_int_t
+ngx_http_request_body_memory_spill(ngx_http_request_t *r)
+{
+    size_t                             size;
+    ngx_buf_t                         *b;
+    ngx_uint_t                         i;
+    ngx_chain_t                       *cl;
+    ngx_http_request_body_t           *rb;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    /* the filters' parts are in the buffers, a saved body spills itself */
+
+    if (ctx->filtering || ctx->replaced) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body spill buffers: %uz", ctx->held);
+
+    if (ngx_http_write_request_body(r, rb->to_write) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->spilled_buffers = 1;
+
+    if (ctx->readv) {
+        rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+        for (i = 1; i < (ngx_uint_t) rblcf->bufs.num; i++) {
+            ngx_http_request_body_free_buf(r, ctx->links[i].buf);
+            ctx->links[i].buf = NULL;
+        }
+
+        b = ctx->links[0].buf;
+        b->pos = b->start;
+        b->last = b->start;
+
+        ctx->links[0].next = NULL;
+        ctx->nlinks = 1;
+        ctx->current = 0;
+
+        rb->buf = b;
+        rb->to_write = &ctx->links[0];
+
+        return NGX_OK;
+    }
+
+    /* rb->buf is in the last link of rb->bufs */
+
+    for (cl = rb->bufs; cl->next; cl = cl->next) { /* void */ }
+
+    size = ngx_http_request_body_buffer_size(r);
+
+    if (!ctx->chunked_body && rb->rest < (off_t) size) {
+        size = (size_t) rb->rest;
+    }
+
+    if (size < (size_t) (rb->buf->end - rb->buf->start)) {
+        b = ngx_http_request_body_alloc_buf(r, size);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_request_body_free_buf(r, rb->buf);
+
+        rb->buf = b;
+        cl->buf = b;
+
+    } else {
+        rb->buf->pos = rb->buf->start;
+        rb->buf->last = rb->buf->start;
+    }
+
+    rb->to_write = cl;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_request_body_memory_done(ngx_http_request_t *r)
+{
+    ngx_http_request_body_memory_cleanup(ngx_http_request_body_ctx(r));
+}
+
+
+static void
+ngx_http_request_body_memory_cleanup(void *data)
+{
+    ngx_http_request_body_ctx_t  *ctx = data;
+
+    if (ctx->queued) {
+        ngx_queue_remove(&ctx->queue);
+        ctx->queued = 0;
+    }
+}
+
+
+static size_t
+ngx_http_request_body_buffer_size(ngx_http_request_t *r)
+{
+    ngx_http_core_loc_conf_t          *clcf;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (rblcf->hist && rblcf->hist->size) {
+        return rblcf->hist->size;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    return clcf->client_body_buffer_size;
+}
+
+
+static void
+ngx_http_request_body_hist_add(ngx_http_request_t *r, off_t len)
+{
+    ngx_uint_t                         i;
+    ngx_http_request_body_hist_t      *hist;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    hist = rblcf->hist;
+
+    if (hist == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NGX_HTTP_REQUEST_BODY_HIST_BUCKETS - 1; i++) {
+        if (len <= ((off_t) 1 << i)) {
+            break;
+        }
+    }
+
+    hist->buckets[i]++;
+    hist->total++;
+
+    if (++hist->samples >= NGX_HTTP_REQUEST_BODY_HIST_UPDATE) {
+        ngx_http_request_body_hist_update(hist);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http client request body adaptive size: %uz "
+                       "single:%ui total:%ui",
+                       hist->size, hist->single, hist->total);
+    }
+}
+
+
+/*
+ * chooses the largest power of two buffer size that keeps the average
+ * buffer memory per request within the budget: the spills go down as
+ * the size grows, the memory goes up.  As in ngx_http_read_request_body(),
+ * a body up to a quarter larger than the size gets a buffer of its own
+ * length, and a larger one spills.  A body is assumed to be as large
+ * as the upper bound of its bucket.
+ */
+
+static void
+ngx_http_request_body_hist_update(ngx_http_request_body_hist_t *hist)
+{
+    size_t      size, best;
+    uint64_t    mem, len, spills, best_spills;
+    ngx_uint_t  i, k, total;
+
+    hist->samples = 0;
+
+    if (hist->total >= NGX_HTTP_REQUEST_BODY_HIST_DECAY) {
+        total = 0;
+
+        for (i = 0; i < NGX_HTTP_REQUEST_BODY_HIST_BUCKETS; i++) {
+            hist->buckets[i] >>= 1;
+            total += hist->buckets[i];
+        }
+
+        hist->total = total;
+    }
+
+    best = 1024;
+    best_spills = hist->total;
+
+    for (k = 10; k < NGX_HTTP_REQUEST_BODY_HIST_BUCKETS; k++) {
+        size = (size_t) 1 << k;
+
+        mem = 0;
+        spills = 0;
+
+        for (i = 0; i < NGX_HTTP_REQUEST_BODY_HIST_BUCKETS; i++) {
+            len = (uint64_t) 1 << i;
+
+            if (len < size + (size >> 2)) {
+                mem += hist->buckets[i] * len;
+
+            } else {
+                mem += hist->buckets[i] * size;
+                spills += hist->buckets[i];
+            }
+        }
+
+        if (mem > (uint64_t) hist->budget * hist->total) {
+            break;
+        }
+
+        best = size;
+        best_spills = spills;
+
+        if (spills == 0) {
+            break;
+        }
+    }
+
+    hist->size = best;
+
+    /* the body is kept in a single buffer if 90% of bodies fit in it */
+
+    hist->single = (best_spills * 10 <= hist->total);
+}
+
+
+static ngx_msec_t
+ngx_http_request_body_elapsed(ngx_http_request_t *r)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+    return (ngx_msec_t) ngx_max(ms, 0);
+}
+
+
+/* the cached time is not updated while a write blocks */
+
+static uint64_t
+ngx_http_request_body_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void
+ngx_http_request_body_recv_stat(ngx_http_request_t *r, ssize_t n)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    ctx->recvs++;
+
+    if (n == NGX_AGAIN) {
+        ctx->agains++;
+        return;
+    }
+
+    if (n <= 0) {
+        return;
+    }
+
+    ctx->event_bytes += n;
+    ctx->last_byte = ngx_http_request_body_elapsed(r);
+
+    if (!ctx->first) {
+        ctx->first_byte = ctx->last_byte;
+        ctx->first = 1;
+    }
+}
+
+
+static void
+ngx_http_request_body_read_done(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t        *ctx;
+    ngx_http_request_body_read_stat_t  *st;
+
+    ctx = ngx_http_request_body_ctx(r);
+    st = &ngx_http_request_body_read_stat;
+
+    ctx->done = 1;
+
+    ngx_http_request_body_memory_done(r);
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body read: first:%M last:%M "
+                   "recv:%ui again:%ui preread:%uz spilled:%O in %uLus",
+                   ctx->first_byte, ctx->last_byte, ctx->recvs, ctx->agains,
+                   ctx->preread, ctx->spilled, ctx->spill_usec);
+
+    st->bodies++;
+    st->modes[ctx->mode]++;
+    st->preread += ctx->preread;
+    st->spilled += ctx->spilled;
+
+    if (ctx->yields) {
+        st->yields += ctx->yields;
+        st->yielded++;
+    }
+
+    st->read_time[ngx_http_request_body_stat_bucket(ctx->last_byte)]++;
+    st->recvs[ngx_http_request_body_stat_bucket(ctx->recvs)]++;
+    st->agains[ngx_http_request_body_stat_bucket(ctx->agains)]++;
+
+    if (ctx->spilled) {
+        st->spill_time[ngx_http_request_body_stat_bucket(ctx->spill_usec)]++;
+    }
+}
+
+
+static void
+ngx_http_request_body_budget_init(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    ctx->event_bytes = 0;
+
+    if (rblcf->read_budget_time) {
+        ctx->event_start = ngx_http_request_body_usec();
+    }
+}
+
+
+/*
+ * a client that keeps the socket readable would hold the worker until
+ * its whole body is read, the budget limits the bytes and the time
+ * spent on one read event
+ */
+
+static ngx_uint_t
+ngx_http_request_body_budget_spent(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    if (!r->connection->read->ready) {
+        return 0;
+    }
+
+    ctx = ngx_http_request_body_ctx(r);
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (rblcf->read_budget && ctx->event_bytes >= rblcf->read_budget) {
+        return 1;
+    }
+
+    if (rblcf->read_budget_time
+        && ngx_http_request_body_usec() - ctx->event_start
+           >= (uint64_t) rblcf->read_budget_time * 1000)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * the socket is still readable, so the read event is posted to be handled
+ * after the other events of this cycle instead of waiting for the kernel
+ */
+
+static void
+ngx_http_request_body_yield(ngx_http_request_t *r)
+{
+    ngx_http_request_body_ctx_t  *ctx;
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http client request body yield after %uz, rest %O",
+                   ctx->event_bytes, r->request_body->rest);
+
+    ctx->yields++;
+
+    ngx_post_event(r->connection->read, &ngx_posted_events);
+}
+
+
+static ngx_uint_t
+ngx_http_request_body_stat_bucket(uint64_t value)
+{
+    ngx_uint_t  n;
+
+    for (n = 0;
+         n < NGX_HTTP_REQUEST_BODY_STAT_BUCKETS - 1
+         && value > ((uint64_t) 1 << n);
+         n++)
+    {
+        /* void */
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                       *p;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    if (r->request_body == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ctx = ngx_http_request_body_ctx(r);
+
+    if (data == NGX_HTTP_REQUEST_BODY_VAR_MODE) {
+        v->len = ngx_http_request_body_modes[ctx->mode].len;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+        v->data = ngx_http_request_body_modes[ctx->mode].data;
+
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN + 8);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    switch (data) {
+
+    case NGX_HTTP_REQUEST_BODY_VAR_FIRST_BYTE:
+        p = ngx_sprintf(p, "%T.%03M", (time_t) ctx->first_byte / 1000,
+                        ctx->first_byte % 1000);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_LAST_BYTE:
+        p = ngx_sprintf(p, "%T.%03M", (time_t) ctx->last_byte / 1000,
+                        ctx->last_byte % 1000);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_RECVS:
+        p = ngx_sprintf(p, "%ui", ctx->recvs);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_AGAINS:
+        p = ngx_sprintf(p, "%ui", ctx->agains);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_PREREAD:
+        p = ngx_sprintf(p, "%uz", ctx->preread);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_SPILLED:
+        p = ngx_sprintf(p, "%O", ctx->spilled);
+        break;
+
+    case NGX_HTTP_REQUEST_BODY_VAR_YIELDS:
+        p = ngx_sprintf(p, "%ui", ctx->yields);
+        break;
+
+    default: /* NGX_HTTP_REQUEST_BODY_VAR_SPILL_TIME */
+        p = ngx_sprintf(p, "%uL.%06uL", ctx->spill_usec / 1000000,
+                        ctx->spill_usec % 1000000);
+        break;
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_status_handler(ngx_http_request_t *r)
+{
+    size_t                              size;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i, k, *buckets;
+    ngx_chain_t                         out;
+    ngx_http_request_body_hist_t       *hist;
+    ngx_http_request_body_read_stat_t  *rs;
+    ngx_http_request_body_pool_stat_t  *st;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    size = sizeof("worker: \n") + NGX_INT64_LEN
+           + sizeof("buffer pool: hits  misses  busy  max  size \n")
+           + 5 * NGX_ATOMIC_T_LEN
+           + sizeof("memory: shared  forced spills \n") + 2 * NGX_ATOMIC_T_LEN
+           + sizeof("spool files: reused  opened \n") + 2 * NGX_ATOMIC_T_LEN
+           + NGX_HTTP_REQUEST_BODY_POOL_CLASSES
+             * (sizeof("buffer pool free : \n") + 2 * NGX_ATOMIC_T_LEN)
+           + sizeof("discard: bytes  closed  refused \n") + NGX_OFF_T_LEN
+           + 2 * NGX_ATOMIC_T_LEN
+#if (NGX_HAVE_LZ4)
+           + sizeof("spool lz4: length  written  blocks  stored \n")
+           + 2 * NGX_OFF_T_LEN + 2 * NGX_ATOMIC_T_LEN
+#endif
+           + sizeof("bodies:  buffered  single_buf  file_only  unbuffered"
+                    "  preread  spilled \n")
+           + 5 * NGX_ATOMIC_T_LEN + 2 * NGX_OFF_T_LEN
+           + sizeof("read yields:  bodies \n") + 2 * NGX_ATOMIC_T_LEN
+           + sizeof("filter tasks:  waits \n") + 2 * NGX_ATOMIC_T_LEN
+           + 4 * (sizeof("last byte time ms:\n")
+                  + NGX_HTTP_REQUEST_BODY_STAT_BUCKETS
+                    * (sizeof("  : \n") + NGX_INT64_LEN + NGX_ATOMIC_T_LEN));
+
+    for (hist = ngx_http_request_body_hists; hist; hist = hist->next) {
+        size += sizeof("location \"\": size  single  total \n")
+                + hist->name.len + 3 * NGX_ATOMIC_T_LEN
+                + NGX_HTTP_REQUEST_BODY_HIST_BUCKETS
+                  * (sizeof("  : \n") + 2 * NGX_ATOMIC_T_LEN);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    st = &ngx_http_request_body_pool_stat;
+
+    b->last = ngx_sprintf(b->last, "worker: %P\n", ngx_pid);
+
+    b->last = ngx_sprintf(b->last,
+                          "buffer pool: hits %ui misses %ui busy %ui max %ui"
+                          " size %uz\n",
+                          st->hits, st->misses, st->busy, st->busy_max,
+                          st->busy_size);
+
+    b->last = ngx_sprintf(b->last, "memory: shared %uA forced spills %ui\n",
+                          ngx_http_request_body_shared
+                          ? *ngx_http_request_body_shared : 0,
+                          st->forced);
+
+    b->last = ngx_sprintf(b->last, "spool files: reused %ui opened %ui\n",
+                          st->spool_hits, st->spool_opens);
+
+    for (i = 0; i < NGX_HTTP_REQUEST_BODY_POOL_CLASSES; i++) {
+        b->last = ngx_sprintf(b->last, "buffer pool free %uz: %ui\n",
+                              (size_t) 1 << (NGX_HTTP_REQUEST_BODY_POOL_SHIFT
+                                             + i),
+                              ngx_http_request_body_classes[i].nfree);
+    }
+
+    b->last = ngx_sprintf(b->last,
+                          "discard: bytes %O closed %ui refused %ui\n",
+                          ngx_http_request_body_discard_stat.bytes,
+                          ngx_http_request_body_discard_stat.closed,
+                          ngx_http_request_body_discard_stat.refused);
+
+#if (NGX_HAVE_LZ4)
+    b->last = ngx_sprintf(b->last,
+                          "spool lz4: length %O written %O blocks %ui"
+                          " stored %ui\n",
+                          ngx_http_request_body_lz4_stat.length,
+                          ngx_http_request_body_lz4_stat.written,
+                          ngx_http_request_body_lz4_stat.blocks,
+                          ngx_http_request_body_lz4_stat.stored);
+#endif
+
+    rs = &ngx_http_request_body_read_stat;
+
+    b->last = ngx_sprintf(b->last,
+                          "bodies: %ui buffered %ui single_buf %ui"
+                          " file_only %ui unbuffered %ui preread %O"
+                          " spilled %O\n",
+                          rs->bodies,
+                          rs->modes[NGX_HTTP_REQUEST_BODY_BUFFERED],
+                          rs->modes[NGX_HTTP_REQUEST_BODY_SINGLE_BUF],
+                          rs->modes[NGX_HTTP_REQUEST_BODY_FILE_ONLY],
+                          rs->modes[NGX_HTTP_REQUEST_BODY_UNBUFFERED],
+                          rs->preread, rs->spilled);
+
+    b->last = ngx_sprintf(b->last, "read yields: %ui bodies %ui\n",
+                          rs->yields, rs->yielded);
+
+    b->last = ngx_sprintf(b->last, "filter tasks: %ui waits %ui\n",
+                          rs->filtered, rs->filter_waits);
+
+    for (k = 0; k < 4; k++) {
+
+        switch (k) {
+
+        case 0:
+            b->last = ngx_cpymem(b->last, "last byte time ms:\n",
+                                 sizeof("last byte time ms:\n") - 1);
+            buckets = rs->read_time;
+            break;
+
+        case 1:
+            b->last = ngx_cpymem(b->last, "recv calls:\n",
+                                 sizeof("recv calls:\n") - 1);
+            buckets = rs->recvs;
+            break;
+
+        case 2:
+            b->last = ngx_cpymem(b->last, "recv again:\n",
+                                 sizeof("recv again:\n") - 1);
+            buckets = rs->agains;
+            break;
+
+        default: /* 3 */
+            b->last = ngx_cpymem(b->last, "spill time us:\n",
+                                 sizeof("spill time us:\n") - 1);
+            buckets = rs->spill_time;
+            break;
+        }
+
+        for (i = 0; i < NGX_HTTP_REQUEST_BODY_STAT_BUCKETS; i++) {
+            if (buckets[i]) {
+                b->last = ngx_sprintf(b->last, "  %uL: %ui\n",
+                                      (uint64_t) 1 << i, buckets[i]);
+            }
+        }
+    }
+
+    for (hist = ngx_http_request_body_hists; hist; hist = hist->next) {
+        b->last = ngx_sprintf(b->last,
+                              "location \"%V\": size %uz single %ui"
+                              " total %ui\n",
+                              &hist->name, hist->size, hist->single,
+                              hist->total);
+
+        for (i = 0; i < NGX_HTTP_REQUEST_BODY_HIST_BUCKETS; i++) {
+            if (hist->buckets[i]) {
+                b->last = ngx_sprintf(b->last, "  %O: %ui\n",
+                                      (off_t) 1 << i, hist->buckets[i]);
+            }
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static char *
+ngx_http_request_body_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_request_body_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+/*以下为忽略body之类的函数，暂时用不上所以暂不分析了：）*/
+ngx_int_t
+ngx_http_discard_request_body(ngx_http_request_t *r)
+{
+    ssize_t                            size;
+    ngx_uint_t                         expect;
+    ngx_event_t                       *rev;
+    ngx_http_request_body_ctx_t       *ctx;
+    ngx_http_request_body_loc_conf_t  *rblcf;
+
+    if (r != r->main || r->discard_body) {
+        return NGX_OK;
+    }
+
+    expect = ngx_http_test_expect(r);
+
+    rev = r->connection->read;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0, "http set discard body");
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    if (r->request_body) {
+
+        ctx = ngx_http_request_body_ctx(r);
+
+        if (ctx->expect && ctx->continue_sent) {
+
+            /* no response may follow a part of "100 Continue" */
+
+            r->connection->error = 1;
+
+        } else if (ctx->expect) {
+
+            /* the body was refused before it was invited */
+
+            ngx_http_request_body_discard_stat.refused++;
+            r->keepalive = 0;
+        }
+
+        return NGX_OK;
+    }
+
+    if (r->headers_in.content_length_n < 0
+        && ngx_http_request_body_is_chunked(r))
+    {
+        /*
+         * the chunked body is not drained, the connection is closed instead,
+         * with lingering close so that the response is not lost to a RST
+         */
+
+        r->keepalive = 0;
+        r->lingering_close = 1;
+        return NGX_OK;
+    }
+
+    if (r->headers_in.content_length_n <= 0) {
+        return NGX_OK;
+    }
+
+    rblcf = ngx_http_get_module_loc_conf(r, ngx_http_request_body_module);
+
+    if (rblcf->discard_max
+        && r->headers_in.content_length_n > rblcf->discard_max)
+    {
+        /*
+         * too large to be drained, the connection is closed instead;
+         * the client may still be sending, so the close lingers for
+         * lingering_time and lingering_timeout at most, or else the RST
+         * sent for the unread data may destroy the response
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                       "http discard body too large: %O",
+                       r->headers_in.content_length_n);
+
+        ngx_http_request_body_discard_stat.closed++;
+
+        r->keepalive = 0;
+        r->lingering_close = 1;
+
+        return NGX_OK;
+    }
+
+    size = r->header_in->last - r->header_in->pos;
+
+    if (expect && size == 0) {
+
+        /*
+         * the client waits for "100 Continue", which is not sent: the body
+         * may never come, the connection is closed after the response
+         */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                       "http discard body not invited");
+
+        ngx_http_request_body_discard_stat.refused++;
+
+        r->keepalive = 0;
+
+        return NGX_OK;
+    }
+
+    if (size) {
+        if (r->headers_in.content_length_n > size) {
+            r->header_in->pos += size;
+            r->headers_in.content_length_n -= size;
+
+        } else {
+            r->header_in->pos += (size_t) r->headers_in.content_length_n;
+            r->headers_in.content_length_n = 0;
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_http_read_discarded_request_body(r) == NGX_OK) {
+        r->lingering_close = 0;
+        return NGX_OK;
+    }
+
+    /* == NGX_AGAIN */
+
+    r->read_event_handler = ngx_http_discarded_request_body_handler;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->count++;
+    r->discard_body = 1;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_discarded_request_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_msec_t                 timer;
+    ngx_event_t               *rev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    rev = c->read;
+
+    if (rev->timedout) {
+        c->timedout = 1;
+        c->error = 1;
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (r->lingering_time) {
+        timer = (ngx_msec_t) (r->lingering_time - ngx_time());
+
+        if (timer <= 0) {
+            r->discard_body = 0;
+            r->lingering_close = 0;
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+    } else {
+        timer = 0;
+    }
+
+    rc = ngx_http_read_discarded_request_body(r);
+
+    if (rc == NGX_OK) {
+        r->discard_body = 0;
+        r->lingering_close = 0;
+        ngx_http_finalize_request(r, NGX_DONE);
+        return;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        c->error = 1;
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (timer) {
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        timer *= 1000;
+
+        if (timer > clcf->lingering_timeout) {
+            timer = clcf->lingering_timeout;
+        }
+
+        ngx_add_timer(rev, timer);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_read_discarded_request_body(ngx_http_request_t *r)
+{
+    size_t      size;
+    ssize_t     n;
+#if (NGX_LINUX)
+    ngx_uint_t  trunc;
+#endif
+    u_char      buffer[NGX_HTTP_DISCARD_BUFFER_SIZE];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http read discarded body");
+
+    /*
+     * on a plain socket the data are dropped by the kernel
+     * with recv(MSG_TRUNC), without copying them to user space
+     */
+
+#if (NGX_LINUX)
+    trunc = (r->connection->recv == ngx_recv);
+#endif
+
+    for ( ;; ) {
+        if (r->headers_in.content_length_n == 0) {
+            r->read_event_handler = ngx_http_block_reading;
+            return NGX_OK;
+        }
+
+        if (!r->connection->read->ready) {
+            return NGX_AGAIN;
+        }
+
+#if (NGX_LINUX)
+        if (trunc) {
+            size = (r->headers_in.content_length_n
+                    > NGX_HTTP_REQUEST_BODY_DISCARD_TRUNC) ?
+                       NGX_HTTP_REQUEST_BODY_DISCARD_TRUNC:
+                       (size_t) r->headers_in.content_length_n;
+
+            n = ngx_http_request_body_recv_trunc(r->connection, size);
+
+        } else
+#endif
+        {
+            size = (r->headers_in.content_length_n
+                    > NGX_HTTP_DISCARD_BUFFER_SIZE) ?
+                       NGX_HTTP_DISCARD_BUFFER_SIZE:
+                       (size_t) r->headers_in.content_length_n;
+
+            n = r->connection->recv(r->connection, buffer, size);
+        }
+
+        if (n == NGX_ERROR) {
+            r->connection->error = 1;
+            return NGX_OK;
+        }
+
+        if (n == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (n == 0) {
+            return NGX_OK;
+        }
+
+        r->headers_in.content_length_n -= n;
+        ngx_http_request_body_discard_stat.bytes += n;
+    }
+}
+
+
+#if (NGX_LINUX)
+
+static ssize_t
+ngx_http_request_body_recv_trunc(ngx_connection_t *c, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    do {
+        n = recv(c->fd, NULL, size, MSG_TRUNC);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recv(MSG_TRUNC): fd:%d %z of %uz", c->fd, n, size);
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return n;
+        }
+
+        if (n > 0) {
+            if ((size_t) n < size
+                && !(ngx_event_flags & NGX_USE_GREEDY_EVENT))
+            {
+                rev->ready = 0;
+            }
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "recv() not ready");
+            n = NGX_AGAIN;
+
+        } else {
+            n = ngx_connection_error(c, err, "recv() failed");
+            break;
+        }
+
+    } while (err == NGX_EINTR);
+
+    rev->ready = 0;
+
+    if (n == NGX_ERROR) {
+        rev->error = 1;
+    }
+
+    return n;
+}
+
+#endif
+
+/*这里只是在判断有没有http 1.1的expect头，应答由ngx_http_request_body_send_continue发送*/
+static ngx_uint_t
+ngx_http_test_expect(ngx_http_request_t *r)
+{
+    ngx_str_t  *expect;
+
+    if (r->expect_tested
+        || r->headers_in.expect == NULL
+        || r->http_version < NGX_HTTP_VERSION_11)
+    {
+        return 0;
+    }
+
+    r->expect_tested = 1;
+
+    expect = &r->headers_in.expect->value;
+
+    if (expect->len != sizeof("100-continue") - 1
+        || ngx_strncasecmp(expect->data, (u_char *) "100-continue",
+                           sizeof("100-continue") - 1)
+           != 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_send_continue(ngx_http_request_t *r)
+{
+    size_t                        size;
+    ssize_t                       n;
+    ngx_connection_t             *c;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    static u_char  line[] = "HTTP/1.1 100 Continue" CRLF CRLF;
+
+    c = r->connection;
+    ctx = ngx_http_request_body_ctx(r);
+
+    size = sizeof(line) - 1 - ctx->continue_sent;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "send 100 Continue: %uz", size);
+
+    n = c->send(c, line + ctx->continue_sent, size);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (n > 0) {
+        ctx->continue_sent += n;
+    }
+
+    if (ctx->continue_sent == sizeof(line) - 1) {
+
+        ctx->expect = 0;
+
+        if (r->write_event_handler == ngx_http_request_body_continue_handler) {
+            r->write_event_handler = ctx->write_event_handler;
+        }
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+
+        return NGX_OK;
+    }
+
+    /* the socket buffer is full, the rest is sent by the write handler */
+
+    if (r->write_event_handler != ngx_http_request_body_continue_handler) {
+        ctx->write_event_handler = r->write_event_handler;
+        r->write_event_handler = ngx_http_request_body_continue_handler;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_add_timer(c->write, clcf->send_timeout);
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_request_body_continue_handler(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    /*
+     * a response after a part of "100 Continue" would not be parsed
+     * by the client, the connection is closed without it
+     */
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    if (!c->write->ready) {
+        return;
+    }
+
+    rc = ngx_http_request_body_send_continue(r);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    if (rc == NGX_ERROR) {
+        c->error = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    r->read_event_handler = ngx_http_read_client_request_body_handler;
+
+    rc = ngx_http_do_read_client_request_body(r);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_request_body_is_chunked(ngx_http_request_t *r)
+{
+    ngx_str_t  *te;
+
+    if (r->headers_in.transfer_encoding == NULL
+        || r->http_version < NGX_HTTP_VERSION_11)
+    {
+        return 0;
+    }
+
+    te = &r->headers_in.transfer_encoding->value;
+
+    return te->len == sizeof("chunked") - 1
+           && ngx_strncasecmp(te->data, (u_char *) "chunked",
+                              sizeof("chunked") - 1)
+              == 0;
+}
+
+
+/*
+ * decodes the chunked data in [b->pos, b->last): the payload is moved
+ * to *dst and *dst is advanced, b->pos is left after the last parsed byte;
+ * rb->rest is set to the minimal number of bytes still expected
+ * or to 0 when the last chunk has been parsed
+ */
+
+static ngx_int_t
+ngx_http_request_body_chunked(ngx_http_request_t *r, ngx_buf_t *b,
+    u_char **dst)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_http_request_body_t      *rb;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_request_body_ctx_t  *ctx;
+
+    rb = r->request_body;
+    ctx = ngx_http_request_body_ctx(r);
+
+    for ( ;; ) {
+
+        rc = ngx_http_request_body_parse_chunked(r, b, &ctx->chunked);
+
+        if (rc == NGX_OK) {
+
+            /* a chunk has been parsed successfully */
+
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+            if (clcf->client_max_body_size
+                && clcf->client_max_body_size - ctx->received
+                   < ctx->chunked.size)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "client intended to send too large chunked "
+                              "body: %O+%O bytes",
+                              ctx->received, ctx->chunked.size);
+
+                return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+            }
+
+            size = b->last - b->pos;
+
+            if ((off_t) size > ctx->chunked.size) {
+                size = (size_t) ctx->chunked.size;
+            }
+
+            if (*dst != b->pos) {
+                ngx_memmove(*dst, b->pos, size);
+            }
+
+            *dst += size;
+            b->pos += size;
+
+            ctx->chunked.size -= size;
+            ctx->received += size;
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* a whole body has been parsed successfully */
+
+            rb->rest = 0;
+            return NGX_OK;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            /* set rb->rest, amount of data we want to see next time */
+
+            rb->rest = ctx->chunked.length;
+            return NGX_OK;
+        }
+
+        /* invalid */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "client sent invalid chunked body");
+
+        return NGX_HTTP_BAD_REQUEST;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_request_body_parse_chunked(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_http_request_body_chunked_t *ctx)
+{
+    u_char     *pos, ch, c;
+    ngx_int_t   rc;
+    enum {
+        sw_chunk_start = 0,
+        sw_chunk_size,
+        sw_chunk_extension,
+        sw_chunk_extension_almost_done,
+        sw_chunk_data,
+        sw_after_data,
+        sw_after_data_almost_done,
+        sw_last_chunk_extension,
+        sw_last_chunk_extension_almost_done,
+        sw_trailer,
+        sw_trailer_almost_done,
+        sw_trailer_header,
+        sw_trailer_header_almost_done
+    } state;
+
+    state = ctx->state;
+
+    if (state == sw_chunk_data && ctx->size == 0) {
+        state = sw_after_data;
+    }
+
+    rc = NGX_AGAIN;
+
+    for (pos = b->pos; pos < b->last; pos++) {
+
+        ch = *pos;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http chunked byte: %02Xd s:%d", ch, state);
+
+        switch (state) {
+
+        case sw_chunk_start:
+            if (ch >= '0' && ch <= '9') {
+                state = sw_chunk_size;
+                ctx->size = ch - '0';
+                break;
+            }
+
+            c = (u_char) (ch | 0x20);
+
+            if (c >= 'a' && c <= 'f') {
+                state = sw_chunk_size;
+                ctx->size = c - 'a' + 10;
+                break;
+            }
+
+            goto invalid;
+
+        case sw_chunk_size:
+            if (ctx->size > NGX_MAX_OFF_T_VALUE / 16) {
+                goto invalid;
+            }
+
+            if (ch >= '0' && ch <= '9') {
+                ctx->size = ctx->size * 16 + (ch - '0');
+                break;
+            }
+
+            c = (u_char) (ch | 0x20);
+
+            if (c >= 'a' && c <= 'f') {
+                ctx->size = ctx->size * 16 + (c - 'a' + 10);
+                break;
+            }
+
+            if (ctx->size == 0) {
+
+                switch (ch) {
+                case CR:
+                    state = sw_last_chunk_extension_almost_done;
+                    break;
+                case LF:
+                    state = sw_trailer;
+                    break;
+                case ';':
+                case ' ':
+                case '\t':
+                    state = sw_last_chunk_extension;
+                    break;
+                default:
+                    goto invalid;
+                }
+
+                break;
+            }
+
+            switch (ch) {
+            case CR:
+                state = sw_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_data;
+                break;
+            case ';':
+            case ' ':
+            case '\t':
+                state = sw_chunk_extension;
+                break;
+            default:
+                goto invalid;
+            }
+
+            break;
+
+        case sw_chunk_extension:
+            switch (ch) {
+            case CR:
+                state = sw_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_data;
+            }
+            break;
+
+        case sw_chunk_extension_almost_done:
+            if (ch == LF) {
+                state = sw_chunk_data;
+                break;
+            }
+            goto invalid;
+
+        case sw_chunk_data:
+            rc = NGX_OK;
+            goto data;
+
+        case sw_after_data:
+            switch (ch) {
+            case CR:
+                state = sw_after_data_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_start;
+                break;
+            default:
+                goto invalid;
+            }
+            break;
+
+        case sw_after_data_almost_done:
+            if (ch == LF) {
+                state = sw_chunk_start;
+                break;
+            }
+            goto invalid;
+
+        case sw_last_chunk_extension:
+            switch (ch) {
+            case CR:
+                state = sw_last_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_trailer;
+            }
+            break;
+
+        case sw_last_chunk_extension_almost_done:
+            if (ch == LF) {
+                state = sw_trailer;
+                break;
+            }
+            goto invalid;
+
+        case sw_trailer:
+            switch (ch) {
+            case CR:
+                state = sw_trailer_almost_done;
+                break;
+            case LF:
+                goto done;
+            default:
+                state = sw_trailer_header;
+            }
+            break;
+
+        case sw_trailer_almost_done:
+            if (ch == LF) {
+                goto done;
+            }
+            goto invalid;
+
+        case sw_trailer_header:
+            switch (ch) {
+            case CR:
+                state = sw_trailer_header_almost_done;
+                break;
+            case LF:
+                state = sw_trailer;
+            }
+            break;
+
+        case sw_trailer_header_almost_done:
+            if (ch == LF) {
+                state = sw_trailer;
+                break;
+            }
+            goto invalid;
+
+        }
+    }
+
+data:
+
+    ctx->state = state;
+    b->pos = pos;
+
+    switch (state) {
+
+    case sw_chunk_start:
+        ctx->length = 3 /* "0" LF LF */;
+        break;
+    case sw_chunk_size:
+        ctx->length = 1 /* LF */
+                      + (ctx->size ? ctx->size + 4 /* LF "0" LF LF */
+                                   : 1 /* LF */);
+        break;
+    case sw_chunk_extension:
+    case sw_chunk_extension_almost_done:
+        ctx->length = 1 /* LF */ + ctx->size + 4 /* LF "0" LF LF */;
+        break;
+    case sw_chunk_data:
+        ctx->length = ctx->size + 4 /* LF "0" LF LF */;
+        break;
+    case sw_after_data:
+    case sw_after_data_almost_done:
+        ctx->length = 4 /* LF "0" LF LF */;
+        break;
+    case sw_last_chunk_extension:
+    case sw_last_chunk_extension_almost_done:
+        ctx->length = 2 /* LF LF */;
+        break;
+    case sw_trailer:
+    case sw_trailer_almost_done:
+        ctx->length = 1 /* LF */;
+        break;
+    case sw_trailer_header:
+    case sw_trailer_header_almost_done:
+        ctx->length = 2 /* LF LF */;
+        break;
+
+    }
+
+    if (ctx->size < 0 || ctx->length < 0) {
+        goto invalid;
+    }
+
+    return rc;
+
+done:
+
+    ctx->state = 0;
+    b->pos = pos + 1;
+
+    return NGX_DONE;
+
+invalid:
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_preconf(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    ngx_http_request_body_hists = NULL;
+    ngx_http_request_body_shared = NULL;
+    ngx_http_request_body_spools = NULL;
+
+    ngx_queue_init(&ngx_http_request_body_inflight);
+    ngx_queue_init(&ngx_http_request_body_uploads);
+
+    ngx_http_request_body_used = ngx_array_create(cf->pool, 4,
+                                    sizeof(ngx_http_input_body_filter_used_pt));
+    if (ngx_http_request_body_used == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_request_body_checked_filter = NULL;
+    ngx_http_request_body_unchecked = 0;
+
+    for (v = ngx_http_request_body_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_init(ngx_conf_t *cf)
+{
+    /*
+     * the module goes before the input body filter modules,
+     * so here the chain consists of the terminating filter only
+     */
+
+    ngx_http_request_body_last_filter = ngx_http_top_input_body_filter;
+    ngx_http_request_body_checked_filter = ngx_http_top_input_body_filter;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_request_body_filter_used(ngx_conf_t *cf,
+    ngx_http_input_body_filter_pt next, ngx_http_input_body_filter_used_pt used)
+{
+    ngx_http_input_body_filter_used_pt  *h;
+
+    if (next != ngx_http_request_body_checked_filter) {
+
+        /* a filter below this one did not tell when it is used */
+
+        ngx_http_request_body_unchecked = 1;
+    }
+
+    h = ngx_array_push(ngx_http_request_body_used);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = used;
+
+    ngx_http_request_body_checked_filter = ngx_http_top_input_body_filter;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_request_body_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_request_body_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_request_body_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->aio = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
+    conf->memory_spool = NGX_CONF_UNSET_SIZE;
+    conf->buffer_pool = NGX_CONF_UNSET;
+    conf->adaptive = NGX_CONF_UNSET_SIZE;
+    conf->discard_max = NGX_CONF_UNSET;
+    conf->read_budget = NGX_CONF_UNSET_SIZE;
+    conf->read_budget_time = NGX_CONF_UNSET_MSEC;
+    conf->memory_budget = NGX_CONF_UNSET_SIZE;
+    conf->memory_shared = NGX_CONF_UNSET;
+    conf->preallocate = NGX_CONF_UNSET;
+    conf->tmpfile = NGX_CONF_UNSET;
+    conf->spool_files = NGX_CONF_UNSET_UINT;
+    conf->directio = NGX_CONF_UNSET_SIZE;
+    conf->preread_copy = NGX_CONF_UNSET;
+    conf->filter_inflight = NGX_CONF_UNSET_UINT;
+#if (NGX_HAVE_LZ4)
+    conf->lz4 = NGX_CONF_UNSET;
+#endif
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bufs.num = 0;
+     *     conf->resumable = NULL;
+     */
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
+    return conf;
+}
+
+
+static char *
+ngx_http_request_body_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_request_body_loc_conf_t *prev = parent;
+    ngx_http_request_body_loc_conf_t *conf = child;
+
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_request_body_hist_t  *hist;
+
+    ngx_conf_merge_value(conf->aio, prev->aio, 0);
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+    ngx_conf_merge_size_value(conf->memory_spool, prev->memory_spool, 0);
+    ngx_conf_merge_value(conf->buffer_pool, prev->buffer_pool, 0);
+    ngx_conf_merge_size_value(conf->adaptive, prev->adaptive, 0);
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs, 0, 0);
+    ngx_conf_merge_off_value(conf->discard_max, prev->discard_max, 0);
+    ngx_conf_merge_size_value(conf->read_budget, prev->read_budget, 0);
+    ngx_conf_merge_msec_value(conf->read_budget_time,
+                              prev->read_budget_time, 0);
+    ngx_conf_merge_size_value(conf->memory_budget, prev->memory_budget, 0);
+    ngx_conf_merge_value(conf->memory_shared, prev->memory_shared, 0);
+    ngx_conf_merge_value(conf->preallocate, prev->preallocate, 0);
+    ngx_conf_merge_value(conf->tmpfile, prev->tmpfile, 0);
+    ngx_conf_merge_uint_value(conf->spool_files, prev->spool_files, 0);
+    ngx_conf_merge_size_value(conf->directio, prev->directio, 0);
+    ngx_conf_merge_value(conf->preread_copy, prev->preread_copy, 1);
+    ngx_conf_merge_uint_value(conf->filter_inflight, prev->filter_inflight, 4);
+
+    if (conf->filter_inflight == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"client_body_filter_inflight\" must be positive");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HAVE_LZ4)
+    ngx_conf_merge_value(conf->lz4, prev->lz4, 0);
+#endif
+
+    if (conf->resumable == NULL) {
+        conf->resumable = prev->resumable;
+    }
+
+    if (conf->spool_files && !conf->tmpfile) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"client_body_spool_files\" requires "
+                           "\"client_body_tmpfile\", ignored");
+        conf->spool_files = 0;
+    }
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
+    /* every location learns the sizes of its own bodies */
+
+    if (conf->adaptive && conf->hist == NULL) {
+        hist = ngx_pcalloc(cf->pool, sizeof(ngx_http_request_body_hist_t));
+        if (hist == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+        hist->name = clcf->name;
+        hist->budget = conf->adaptive;
+
+        hist->next = ngx_http_request_body_hists;
+        ngx_http_request_body_hists = hist;
+
+        conf->hist = hist;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_request_body_aio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_request_body_loc_conf_t *rblcf = conf;
+
+    ngx_str_t  *value;
+#if (NGX_THREADS)
+    ngx_str_t   name;
+#endif
+
+    if (rblcf->aio != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rblcf->aio = 0;
+#if (NGX_THREADS)
+        rblcf->thread_pool = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+        rblcf->aio = 1;
+
+        if (value[1].len > 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            rblcf->thread_pool = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            rblcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (rblcf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"client_body_aio threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    return "invalid value";
+}
+
+
+static char *
+ngx_http_request_body_memory_budget(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_request_body_loc_conf_t *rblcf = conf;
+
+    ngx_str_t       *value, name;
+    ngx_shm_zone_t  *shm_zone;
+
+    if (rblcf->memory_budget != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rblcf->memory_budget = 0;
+        rblcf->memory_shared = 0;
+        return NGX_CONF_OK;
+    }
+
+    rblcf->memory_budget = ngx_parse_size(&value[1]);
+    if (rblcf->memory_budget == (size_t) NGX_ERROR) {
+        return "invalid value";
+    }
+
+    rblcf->memory_shared = 0;
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "shared") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* one zone counts the buffers of all the workers */
+
+    ngx_str_set(&name, "client_body_memory");
+
+    shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                     &ngx_http_request_body_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_request_body_memory_init_zone;
+
+    rblcf->memory_shared = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_request_body_memory_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_atomic_t     *held;
+    ngx_slab_pool_t  *shpool;
+
+    /* the old workers still release their buffers to the same counter */
+
+    if (data) {
+        shm_zone->data = data;
+        ngx_http_request_body_shared = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        ngx_http_request_body_shared = shpool->data;
+        return NGX_OK;
+    }
+
+    held = ngx_slab_alloc(shpool, sizeof(ngx_atomic_t));
+    if (held == NULL) {
+        return NGX_ERROR;
+    }
+
+    *held = 0;
+
+    shpool->data = (void *) held;
+    shm_zone->data = (void *) held;
+    ngx_http_request_body_shared = held;
+
+    return NGX_OK;
 }
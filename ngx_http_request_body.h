@@ -0,0 +1,224 @@
+#ifndef _NGX_HTTP_REQUEST_BODY_H_INCLUDED_
+#define _NGX_HTTP_REQUEST_BODY_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * the handler is called for every received part of the body:
+ *
+ *     NGX_OK: the data were consumed and the buffer may be reused;
+ *     NGX_AGAIN: the buffer is still in use, reading is stopped until
+ *                ngx_http_resume_client_request_body() is called;
+ *     NGX_ERROR or an http status code: reading is aborted.
+ *
+ * buf->last_buf is set on the part that completes the body,
+ * post_handler is called after it has been consumed
+ */
+
+typedef ngx_int_t (*ngx_http_client_body_data_handler_pt)
+    (ngx_http_request_t *r, ngx_buf_t *buf);
+
+
+/*
+ * "100 Continue" is sent when the body is first read from the socket, the
+ * body is not read until it is sent in full; a handler that refuses the
+ * request before reading the body finalizes it with the error, the client
+ * is not invited to send the body and the connection is closed after the
+ * response
+ */
+
+ngx_int_t ngx_http_read_unbuffered_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_data_handler_pt data_handler,
+    ngx_http_client_body_handler_pt post_handler);
+void ngx_http_resume_client_request_body(ngx_http_request_t *r);
+
+/*
+ * reads the body as ngx_http_read_client_request_body() does; with
+ * "client_body_spool_lz4 on" the part spooled to a file is kept in LZ4
+ * blocks, the consumer reads it with ngx_http_request_body_read_file() or
+ * ngx_http_request_body_map(), which decompress it on demand, and does not
+ * send the file of the in_file buffer of r->request_body->bufs as is
+ */
+
+ngx_int_t ngx_http_read_compressed_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler);
+
+/*
+ * maps the body spooled to a file as a contiguous region, the mapping
+ * lives as long as the request pool; NGX_DECLINED means the body is not
+ * all in the file, a part preread in memory may precede it, and is
+ * available from r->request_body->bufs only
+ */
+
+ngx_int_t ngx_http_request_body_map(ngx_http_request_t *r, ngx_str_t *body);
+
+/*
+ * reads the body spooled to the temp file starting at offset, the LZ4
+ * blocks of a body read with ngx_http_read_compressed_request_body()
+ * are decompressed
+ */
+
+ssize_t ngx_http_request_body_read_file(ngx_http_request_t *r, u_char *buf,
+    size_t size, off_t offset);
+
+/*
+ * ngx_http_request_body_contiguous() returns the body read as one region:
+ * a single buffer as is, a file mapped, several buffers copied once, the
+ * copy replaces them in r->request_body->bufs.  ngx_http_request_body_view()
+ * returns up to *nparts in memory parts of the body without copying.
+ * A body read without request_body_in_single_buf may have two of them,
+ * the part preread with the header and the rest; request_body_in_single_buf
+ * still copies the preread part so the body is in one buffer.
+ * NGX_DECLINED means the body is not read yet, is partly in a file, or has
+ * more parts
+ */
+
+ngx_int_t ngx_http_request_body_contiguous(ngx_http_request_t *r,
+    ngx_str_t *body);
+ngx_int_t ngx_http_request_body_view(ngx_http_request_t *r, ngx_str_t *parts,
+    ngx_uint_t *nparts);
+
+/*
+ * a consumer that no longer needs the body read calls
+ * ngx_http_request_body_free(): the memory buffers are released before
+ * the request is finalized and only the file, if any, is left in
+ * r->request_body->bufs
+ */
+
+void ngx_http_request_body_free(ngx_http_request_t *r);
+
+/*
+ * a module installing an input body filter adds, right after it, the
+ * handler telling whether the filter is used for the request, the filter
+ * below it is passed as next.  The body is spliced to the temp file only
+ * when none of the filters is used; a filter added without the handler
+ * disables splicing
+ */
+
+typedef ngx_uint_t (*ngx_http_input_body_filter_used_pt)(ngx_http_request_t *r);
+
+ngx_int_t ngx_http_request_body_filter_used(ngx_conf_t *cf,
+    ngx_http_input_body_filter_pt next, ngx_http_input_body_filter_used_pt used);
+
+/*
+ * an input body filter that transforms the body calls
+ * ngx_http_request_body_replace() on its first call: the received data
+ * are dropped once the filters have seen them, and r->request_body->bufs
+ * or the temp file hold only the buffers the filter passes to
+ * ngx_http_request_body_save(), which takes them over.  NGX_DECLINED
+ * means the body is read by a data handler and is kept as received
+ */
+
+ngx_int_t ngx_http_request_body_replace(ngx_http_request_t *r);
+ngx_buf_t *ngx_http_request_body_get_buf(ngx_http_request_t *r, size_t size);
+ngx_int_t ngx_http_request_body_save(ngx_http_request_t *r, ngx_buf_t *b);
+
+/*
+ * an input body filter whose consumer cannot keep up calls
+ * ngx_http_request_body_block(): reading from the client stops after
+ * the part being filtered until ngx_http_request_body_unblock(), which
+ * is not to be called from a filter, continues it
+ */
+
+void ngx_http_request_body_block(ngx_http_request_t *r);
+void ngx_http_request_body_unblock(ngx_http_request_t *r);
+
+/*
+ * an input body filter may hand the part to a thread pool task: it calls
+ * ngx_http_request_body_filter_async() with the buffer to be passed on and
+ * the next filter, and returns NGX_AGAIN.  The part's memory is kept as is
+ * and the body is read on into the rest of the buffer while fewer than
+ * client_body_filter_inflight parts are held, the buffer is not written
+ * out, delivered or reused and the body is not complete before all of them
+ * are done.  A read following parts filtered at once may fill up to
+ * client_body_buffers buffers before a filter holds one.
+ *
+ * The task calls ngx_http_request_body_filter_done() for the part, not from
+ * the filter itself, with NGX_OK or the error the request is finalized with
+ * once the other tasks are done.  The parts are passed on to the next
+ * filter in the order received, whatever order the tasks complete in; a
+ * filter that has parts held hands the later ones to tasks as well.
+ */
+
+typedef struct ngx_http_request_body_part_s  ngx_http_request_body_part_t;
+
+ngx_http_request_body_part_t *ngx_http_request_body_filter_async(
+    ngx_http_request_t *r, ngx_buf_t *b, ngx_http_input_body_filter_pt next);
+void ngx_http_request_body_filter_done(ngx_http_request_t *r,
+    ngx_http_request_body_part_t *part, ngx_int_t rc);
+
+
+/*
+ * the parts of a multipart/form-data body parsed by the multipart body
+ * filter, available once the body is read: a form field is in value,
+ * a part with filename and a field larger than
+ * client_body_multipart_field_size are in file; NULL is returned
+ * for a body that is not parsed
+ */
+
+typedef struct {
+    ngx_str_t                  name;
+    ngx_str_t                  filename;
+    ngx_str_t                  content_type;
+    ngx_str_t                  value;
+    ngx_temp_file_t           *file;
+    off_t                      size;
+} ngx_http_body_multipart_part_t;
+
+
+ngx_array_t *ngx_http_body_multipart_parts(ngx_http_request_t *r);
+
+
+/*
+ * the body tee filter gives every part of the body, as it is received,
+ * to the sinks added with ngx_http_body_tee_add() before the body is read.
+ * The handler consumes what it can and returns NGX_OK once all of it is
+ * consumed, NGX_AGAIN with b->pos moved past the part consumed, or
+ * NGX_ERROR; b is NULL when the sink is detached.  The rest is queued, up
+ * to max_size bytes, and a sink that can take more calls
+ * ngx_http_body_tee_drained().  Once the queue is full a blocking sink
+ * stops reading from the client, the others drop the data or are detached
+ */
+
+#define NGX_HTTP_BODY_TEE_BLOCK    0
+#define NGX_HTTP_BODY_TEE_DROP     1
+#define NGX_HTTP_BODY_TEE_DETACH   2
+
+
+typedef struct ngx_http_body_tee_sink_s  ngx_http_body_tee_sink_t;
+
+typedef ngx_int_t (*ngx_http_body_tee_handler_pt)(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink, ngx_buf_t *b);
+
+
+struct ngx_http_body_tee_sink_s {
+    ngx_str_t                      name;
+    ngx_http_body_tee_handler_pt   handler;
+    void                          *data;
+    size_t                         max_size;
+    ngx_uint_t                     policy;
+
+    off_t                          sent;
+    off_t                          dropped;
+    size_t                         queued;
+
+    ngx_chain_t                   *queue;
+    ngx_chain_t                   *tail;
+    ngx_chain_t                   *free;
+
+    unsigned                       blocking:1;
+    unsigned                       detached:1;
+    unsigned                       done:1;
+};
+
+
+ngx_http_body_tee_sink_t *ngx_http_body_tee_add(ngx_http_request_t *r);
+void ngx_http_body_tee_drained(ngx_http_request_t *r,
+    ngx_http_body_tee_sink_t *sink);
+
+
+#endif /* _NGX_HTTP_REQUEST_BODY_H_INCLUDED_ */
@@ -0,0 +1,827 @@
+/*
+ * a benchmark of the request body reader: the requests are run against
+ * a mock connection whose recv() replays scripted arrival patterns, for
+ * every combination of the pattern and the body mode it reports
+ *
+ *     throughput of the body bytes, MB/s;
+ *     recv() and write() calls per MB;
+ *     ngx_alloc() and ngx_memalign() calls per request;
+ *     the most memory allocated by a request, what it freed included.
+ *
+ * the harness is linked with the objects of an nginx built with this
+ * module, all but the one with main(); the wrapped functions are counted
+ * or, as ngx_http_finalize_request(), kept away from the real connection.
+ * ngx_http_request_body_bench.sh builds it in the nginx tree and runs it:
+ *
+ *     ./configure ... && make
+ *     sh ngx_http_request_body_bench.sh <nginx dir> [options]
+ *
+ * which runs
+ *
+ *     objs/body_bench [-n requests] [-s size] [-g gigabytes] [-t dir]
+ *
+ * -s is the body size of the patterns, 64k by default, the preread one
+ * is capped at 64k; -g adds a single stream of the given size per mode;
+ * the temp files are created in -t, /tmp by default, and are removed
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_http.h>
+
+
+#define NGX_BENCH_PREREAD_MAX  65536
+#define NGX_BENCH_MTU          1448
+
+
+extern ngx_module_t  ngx_http_request_body_module;
+
+
+typedef enum {
+    ngx_bench_preread = 0,
+    ngx_bench_dribble,
+    ngx_bench_mtu,
+    ngx_bench_bursty,
+    ngx_bench_stream
+} ngx_bench_pattern_e;
+
+
+typedef enum {
+    ngx_bench_buffered = 0,
+    ngx_bench_single_buf,
+    ngx_bench_file_only,
+    ngx_bench_discard
+} ngx_bench_mode_e;
+
+
+typedef struct {
+    ngx_bench_pattern_e        pattern;
+    off_t                      rest;
+
+    /* the bytes available until the next EAGAIN */
+    size_t                     burst;
+    ngx_uint_t                 segments;
+    uint32_t                   seed;
+} ngx_bench_stream_t;
+
+
+typedef struct {
+    ngx_uint_t                 requests;
+    off_t                      bytes;
+    uint64_t                   usec;
+    ngx_uint_t                 recvs;
+    ngx_uint_t                 writes;
+    ngx_uint_t                 allocs;
+    size_t                     allocated;
+    ngx_uint_t                 filter_calls;
+    ngx_uint_t                 failed;
+} ngx_bench_result_t;
+
+
+ssize_t __real_write(int fd, const void *buf, size_t n);
+ssize_t __real_writev(int fd, const struct iovec *iov, int n);
+ssize_t __real_pwrite(int fd, const void *buf, size_t n, off_t offset);
+ssize_t __real_pwritev(int fd, const struct iovec *iov, int n,
+    off_t offset);
+void *__real_ngx_alloc(size_t size, ngx_log_t *log);
+void *__real_ngx_memalign(size_t alignment, size_t size, ngx_log_t *log);
+void __real_ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
+
+static ngx_int_t ngx_bench_init(ngx_log_t *log, char *temp);
+static ngx_int_t ngx_bench_conf(ngx_log_t *log, char *temp);
+static void ngx_bench_run(ngx_bench_pattern_e pattern, ngx_bench_mode_e mode,
+    off_t size, ngx_uint_t n, ngx_bench_result_t *res);
+static ngx_int_t ngx_bench_request(ngx_bench_pattern_e pattern,
+    ngx_bench_mode_e mode, off_t size, ngx_bench_result_t *res);
+static ssize_t ngx_bench_recv(ngx_connection_t *c, u_char *buf, size_t size);
+static ssize_t ngx_bench_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit);
+static size_t ngx_bench_available(ngx_bench_stream_t *s, size_t size);
+static ngx_int_t ngx_bench_filter(ngx_http_request_t *r, ngx_buf_t *b);
+static void ngx_bench_post_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_bench_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static uint64_t ngx_bench_usec(void);
+static void ngx_bench_report(ngx_bench_pattern_e pattern,
+    ngx_bench_mode_e mode, off_t size, ngx_bench_result_t *res);
+
+
+static char  *ngx_bench_patterns[] = {
+    "preread", "dribble", "mtu", "bursty", "stream"
+};
+
+static char  *ngx_bench_modes[] = {
+    "buffered", "single_buf", "file_only", "discard"
+};
+
+
+static ngx_cycle_t          ngx_bench_cycle;
+static ngx_log_t            ngx_bench_log;
+static ngx_open_file_t      ngx_bench_log_file;
+static void               **ngx_bench_loc_conf;
+
+static ngx_connection_t     ngx_bench_connection;
+static ngx_event_t          ngx_bench_read_event;
+static ngx_event_t          ngx_bench_write_event;
+static ngx_bench_stream_t   ngx_bench_replay;
+
+static u_char               ngx_bench_data[65536];
+
+static ngx_uint_t           ngx_bench_recvs;
+static ngx_uint_t           ngx_bench_writes;
+static ngx_uint_t           ngx_bench_allocs;
+static size_t               ngx_bench_allocated;
+static ngx_uint_t           ngx_bench_filter_calls;
+static ngx_uint_t           ngx_bench_done;
+static ngx_int_t            ngx_bench_finalized;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    off_t                size, len, stream;
+    char                *temp;
+    ngx_int_t            i, n, count;
+    ngx_bench_mode_e     mode;
+    ngx_bench_result_t   res;
+    ngx_bench_pattern_e  pattern;
+
+    n = 1000;
+    size = 65536;
+    stream = 0;
+    temp = "/tmp";
+
+    for (i = 1; i < argc - 1; i += 2) {
+
+        if (ngx_strcmp(argv[i], "-n") == 0) {
+            n = ngx_atoi((u_char *) argv[i + 1], ngx_strlen(argv[i + 1]));
+
+        } else if (ngx_strcmp(argv[i], "-s") == 0) {
+            size = ngx_atoof((u_char *) argv[i + 1],
+                             ngx_strlen(argv[i + 1]));
+
+        } else if (ngx_strcmp(argv[i], "-g") == 0) {
+            stream = ngx_atoof((u_char *) argv[i + 1],
+                               ngx_strlen(argv[i + 1]));
+            stream *= 1024 * 1024 * 1024;
+
+        } else if (ngx_strcmp(argv[i], "-t") == 0) {
+            temp = argv[i + 1];
+
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc || n <= 0 || size <= 0 || stream < 0) {
+        ngx_write_stderr("usage: body_bench [-n requests] [-s size] "
+                         "[-g gigabytes] [-t dir]" NGX_LINEFEED);
+        return 1;
+    }
+
+    if (ngx_bench_init(&ngx_bench_log, temp) != NGX_OK) {
+        return 1;
+    }
+
+    printf("%-8s %-10s %12s %6s %10s %10s %10s %10s %10s\n",
+           "pattern", "mode", "size", "reqs", "MB/s", "recv/MB",
+           "write/MB", "alloc/req", "allocated");
+
+    for (pattern = ngx_bench_preread; pattern < ngx_bench_stream; pattern++)
+    {
+        len = (pattern == ngx_bench_preread)
+              ? ngx_min(size, NGX_BENCH_PREREAD_MAX) : size;
+
+        /* a byte per event is slow enough with a hundredth of requests */
+
+        count = (pattern == ngx_bench_dribble) ? ngx_max(n / 100, 1) : n;
+
+        for (mode = ngx_bench_buffered; mode <= ngx_bench_discard; mode++) {
+            ngx_bench_run(pattern, mode, len, (ngx_uint_t) count, &res);
+            ngx_bench_report(pattern, mode, len, &res);
+        }
+    }
+
+    if (stream) {
+        for (mode = ngx_bench_buffered; mode <= ngx_bench_discard; mode++) {
+            ngx_bench_run(ngx_bench_stream, mode, stream, 1, &res);
+            ngx_bench_report(ngx_bench_stream, mode, stream, &res);
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_init(ngx_log_t *log, char *temp)
+{
+    ngx_uint_t  i;
+
+    ngx_bench_log_file.fd = ngx_stderr;
+    log->file = &ngx_bench_log_file;
+    log->log_level = NGX_LOG_ERR;
+
+    ngx_time_init();
+
+    if (ngx_os_init(log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_bench_cycle.log = log;
+    ngx_bench_cycle.pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, log);
+    if (ngx_bench_cycle.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&ngx_bench_cycle.paths, ngx_bench_cycle.pool, 4,
+                       sizeof(ngx_path_t *))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&ngx_bench_cycle.prefix, "/");
+    ngx_str_set(&ngx_bench_cycle.conf_prefix, "/");
+
+    ngx_cycle = &ngx_bench_cycle;
+
+    if (ngx_event_timer_init(log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* a read event is "added" by flagging it as active */
+
+    ngx_event_actions.add = ngx_bench_add_event;
+    ngx_event_flags = NGX_USE_CLEAR_EVENT;
+
+    for (i = 0; i < sizeof(ngx_bench_data); i++) {
+        ngx_bench_data[i] = (u_char) ('a' + i % 26);
+    }
+
+    return ngx_bench_conf(log, temp);
+}
+
+
+/*
+ * the location configuration is created and merged for the modules the
+ * body reader looks at, the other ones are left NULL
+ */
+
+static ngx_int_t
+ngx_bench_conf(ngx_log_t *log, char *temp)
+{
+    void                      **main;
+    ngx_uint_t                  i;
+    ngx_conf_t                  cf;
+    ngx_path_t                 *path;
+    ngx_http_module_t          *module;
+    ngx_http_conf_ctx_t         ctx;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    ngx_max_module = 0;
+    ngx_http_max_module = 0;
+
+    for (i = 0; ngx_modules[i]; i++) {
+        ngx_modules[i]->index = ngx_max_module++;
+
+        if (ngx_modules[i]->type == NGX_HTTP_MODULE) {
+            ngx_modules[i]->ctx_index = ngx_http_max_module++;
+        }
+    }
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+
+    cf.pool = ngx_bench_cycle.pool;
+    cf.temp_pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, log);
+    cf.cycle = &ngx_bench_cycle;
+    cf.log = log;
+    cf.ctx = &ctx;
+    cf.module_type = NGX_HTTP_MODULE;
+    cf.cmd_type = NGX_HTTP_LOC_CONF;
+
+    if (cf.temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    main = ngx_pcalloc(cf.pool, sizeof(void *) * ngx_http_max_module);
+    ngx_bench_loc_conf = ngx_pcalloc(cf.pool,
+                                     sizeof(void *) * ngx_http_max_module);
+
+    if (main == NULL || ngx_bench_loc_conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx.main_conf = main;
+    ctx.srv_conf = main;
+    ctx.loc_conf = ngx_bench_loc_conf;
+
+    /* the bottom of the input body filter chain counts the calls */
+
+    ngx_http_top_input_body_filter = ngx_bench_filter;
+
+    for (i = 0; ngx_modules[i]; i++) {
+
+        if (ngx_modules[i] != &ngx_http_core_module
+            && ngx_modules[i] != &ngx_http_request_body_module)
+        {
+            continue;
+        }
+
+        module = ngx_modules[i]->ctx;
+
+        if (module->create_loc_conf) {
+            void  *parent;
+
+            parent = module->create_loc_conf(&cf);
+            ngx_bench_loc_conf[ngx_modules[i]->ctx_index] =
+                                                  module->create_loc_conf(&cf);
+
+            if (parent == NULL
+                || ngx_bench_loc_conf[ngx_modules[i]->ctx_index] == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            if (module->merge_loc_conf
+                && module->merge_loc_conf(&cf, parent,
+                                   ngx_bench_loc_conf[ngx_modules[i]->ctx_index])
+                   != NGX_CONF_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ngx_modules[i] == &ngx_http_request_body_module
+            && module->postconfiguration
+            && module->postconfiguration(&cf) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    path = ngx_pcalloc(cf.pool, sizeof(ngx_path_t));
+    if (path == NULL) {
+        return NGX_ERROR;
+    }
+
+    path->name.data = (u_char *) temp;
+    path->name.len = ngx_strlen(temp);
+
+    clcf = ngx_bench_loc_conf[ngx_http_core_module.ctx_index];
+    clcf->client_body_temp_path = path;
+    clcf->client_max_body_size = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_run(ngx_bench_pattern_e pattern, ngx_bench_mode_e mode, off_t size,
+    ngx_uint_t n, ngx_bench_result_t *res)
+{
+    uint64_t    start;
+    ngx_uint_t  i;
+
+    ngx_memzero(res, sizeof(ngx_bench_result_t));
+
+    ngx_bench_recvs = 0;
+    ngx_bench_writes = 0;
+    ngx_bench_allocs = 0;
+    ngx_bench_filter_calls = 0;
+
+    start = ngx_bench_usec();
+
+    for (i = 0; i < n; i++) {
+        if (ngx_bench_request(pattern, mode, size, res) != NGX_OK) {
+            res->failed++;
+        }
+    }
+
+    res->usec = ngx_bench_usec() - start;
+    res->requests = n;
+    res->recvs = ngx_bench_recvs;
+    res->writes = ngx_bench_writes;
+    res->allocs = ngx_bench_allocs;
+    res->filter_calls = ngx_bench_filter_calls;
+}
+
+
+static ngx_int_t
+ngx_bench_request(ngx_bench_pattern_e pattern, ngx_bench_mode_e mode,
+    off_t size, ngx_bench_result_t *res)
+{
+    size_t               preread;
+    ngx_int_t            rc;
+    ngx_time_t          *tp;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    c = &ngx_bench_connection;
+
+    ngx_memzero(c, sizeof(ngx_connection_t));
+    ngx_memzero(&ngx_bench_read_event, sizeof(ngx_event_t));
+    ngx_memzero(&ngx_bench_write_event, sizeof(ngx_event_t));
+
+    ngx_bench_allocated = 0;
+
+    c->fd = (ngx_socket_t) -1;
+    c->log = &ngx_bench_log;
+    c->read = &ngx_bench_read_event;
+    c->write = &ngx_bench_write_event;
+    c->recv = ngx_bench_recv;
+    c->recv_chain = ngx_bench_recv_chain;
+
+    c->read->log = c->log;
+    c->read->data = c;
+    c->read->ready = 1;
+    c->write->log = c->log;
+    c->write->data = c;
+
+    c->pool = ngx_create_pool(1024, c->log);
+    if (c->pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    r = ngx_pcalloc(c->pool, sizeof(ngx_http_request_t));
+    if (r == NULL) {
+        goto failed;
+    }
+
+    r->pool = ngx_create_pool(4096, c->log);
+    if (r->pool == NULL) {
+        goto failed;
+    }
+
+    r->ctx = ngx_pcalloc(r->pool, sizeof(void *) * ngx_http_max_module);
+    if (r->ctx == NULL) {
+        goto failed;
+    }
+
+    if (ngx_list_init(&r->headers_in.headers, r->pool, 4,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    r->signature = NGX_HTTP_MODULE;
+    r->connection = c;
+    r->main = r;
+    r->count = 1;
+    r->loc_conf = ngx_bench_loc_conf;
+    r->http_version = NGX_HTTP_VERSION_11;
+    r->method = NGX_HTTP_POST;
+    r->keepalive = 1;
+    tp = ngx_timeofday();
+    r->start_sec = tp->sec;
+    r->start_msec = tp->msec;
+    r->headers_in.content_length_n = size;
+    r->read_event_handler = ngx_http_block_reading;
+
+    r->request_body_in_clean_file = 1;
+    r->request_body_in_single_buf = (mode == ngx_bench_single_buf);
+    r->request_body_in_file_only = (mode == ngx_bench_file_only);
+
+    c->data = r;
+
+    /* the body that arrived along with the header */
+
+    preread = (pattern == ngx_bench_preread) ? (size_t) size : 0;
+
+    r->header_in = ngx_create_temp_buf(r->pool, preread + 1024);
+    if (r->header_in == NULL) {
+        goto failed;
+    }
+
+    r->header_in->last = ngx_cpymem(r->header_in->last, ngx_bench_data,
+                                    preread);
+
+    ngx_memzero(&ngx_bench_replay, sizeof(ngx_bench_stream_t));
+
+    ngx_bench_replay.pattern = pattern;
+    ngx_bench_replay.rest = size - preread;
+    ngx_bench_replay.seed = 1;
+
+    ngx_bench_done = 0;
+    ngx_bench_finalized = NGX_DECLINED;
+
+    if (mode == ngx_bench_discard) {
+        rc = ngx_http_discard_request_body(r);
+
+        if (rc == NGX_OK && !r->discard_body) {
+            ngx_bench_done = 1;
+        }
+
+    } else {
+        rc = ngx_http_read_client_request_body(r, ngx_bench_post_handler);
+    }
+
+    /* every "event" makes the socket readable again */
+
+    while (!ngx_bench_done && rc < NGX_HTTP_SPECIAL_RESPONSE) {
+        if (ngx_bench_finalized != NGX_DECLINED) {
+
+            if (mode == ngx_bench_discard
+                && ngx_bench_finalized == NGX_DONE)
+            {
+                ngx_bench_done = 1;
+            }
+
+            break;
+        }
+
+        c->read->ready = 1;
+        r->read_event_handler(r);
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    res->bytes += size;
+
+    if (ngx_bench_allocated > res->allocated) {
+        res->allocated = ngx_bench_allocated;
+    }
+
+    ngx_destroy_pool(r->pool);
+    ngx_destroy_pool(c->pool);
+
+    return ngx_bench_done ? NGX_OK : NGX_ERROR;
+
+failed:
+
+    if (r && r->pool) {
+        ngx_destroy_pool(r->pool);
+    }
+
+    ngx_destroy_pool(c->pool);
+
+    return NGX_ERROR;
+}
+
+
+static ssize_t
+ngx_bench_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t  n, k;
+
+    ngx_bench_recvs++;
+
+    n = ngx_bench_available(&ngx_bench_replay, size);
+
+    if (n == 0) {
+        if (ngx_bench_replay.rest == 0) {
+            return 0;
+        }
+
+        c->read->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    ngx_bench_replay.rest -= n;
+    ngx_bench_replay.burst -= n;
+
+    for (k = 0; k < n; k += sizeof(ngx_bench_data)) {
+        ngx_memcpy(buf + k, ngx_bench_data,
+                   ngx_min(n - k, sizeof(ngx_bench_data)));
+    }
+
+    return n;
+}
+
+
+/* one readv() fills the buffers with what is available */
+
+static ssize_t
+ngx_bench_recv_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        size = in->buf->end - in->buf->last;
+
+        if (limit && total + (off_t) size > limit) {
+            size = (size_t) (limit - total);
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        n = ngx_bench_available(&ngx_bench_replay, size);
+
+        if (n == 0) {
+            break;
+        }
+
+        ngx_bench_replay.rest -= n;
+        ngx_bench_replay.burst -= n;
+
+        ngx_memcpy(in->buf->last, ngx_bench_data,
+                   ngx_min((size_t) n, sizeof(ngx_bench_data)));
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    ngx_bench_recvs++;
+
+    if (total) {
+        return total;
+    }
+
+    if (ngx_bench_replay.rest == 0) {
+        return 0;
+    }
+
+    c->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * dribble: 1 byte per readiness event;
+ * mtu: 10 segments of 1448 bytes, one per recv(), per event;
+ * bursty: bursts of up to 64k per event;
+ * stream and preread: everything is always available
+ */
+
+static size_t
+ngx_bench_available(ngx_bench_stream_t *s, size_t size)
+{
+    if (s->rest == 0) {
+        return 0;
+    }
+
+    if (s->burst == 0) {
+
+        if (s->segments) {
+            s->segments = 0;
+            return 0;
+        }
+
+        switch (s->pattern) {
+
+        case ngx_bench_dribble:
+            s->burst = 1;
+            break;
+
+        case ngx_bench_mtu:
+            s->burst = 10 * NGX_BENCH_MTU;
+            break;
+
+        case ngx_bench_bursty:
+            s->seed = s->seed * 1103515245 + 12345;
+            s->burst = 1 + (s->seed >> 8) % 65536;
+            break;
+
+        default:
+            s->burst = NGX_MAX_SIZE_T_VALUE;
+            break;
+        }
+
+        s->segments = 1;
+    }
+
+    if (s->pattern == ngx_bench_mtu && size > NGX_BENCH_MTU) {
+        size = NGX_BENCH_MTU;
+    }
+
+    if (size > s->burst) {
+        size = s->burst;
+    }
+
+    if ((off_t) size > s->rest) {
+        size = (size_t) s->rest;
+    }
+
+    return size;
+}
+
+
+static ngx_int_t
+ngx_bench_filter(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_bench_filter_calls++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_post_handler(ngx_http_request_t *r)
+{
+    ngx_bench_done = 1;
+}
+
+
+static ngx_int_t
+ngx_bench_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static uint64_t
+ngx_bench_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void
+ngx_bench_report(ngx_bench_pattern_e pattern, ngx_bench_mode_e mode,
+    off_t size, ngx_bench_result_t *res)
+{
+    double  mb;
+
+    mb = (double) res->bytes / (1024 * 1024);
+
+    printf("%-8s %-10s %12lld %6lu %10.1f %10.1f %10.1f %10.1f %10lu%s\n",
+           ngx_bench_patterns[pattern], ngx_bench_modes[mode],
+           (long long) size, (unsigned long) res->requests,
+           res->usec ? mb * 1000000 / res->usec : 0.0,
+           mb ? res->recvs / mb : 0.0,
+           mb ? res->writes / mb : 0.0,
+           (double) res->allocs / res->requests,
+           (unsigned long) res->allocated,
+           res->failed ? " FAILED" : "");
+}
+
+
+/* the wrapped functions */
+
+ssize_t
+__wrap_write(int fd, const void *buf, size_t n)
+{
+    ngx_bench_writes++;
+    return __real_write(fd, buf, n);
+}
+
+
+ssize_t
+__wrap_writev(int fd, const struct iovec *iov, int n)
+{
+    ngx_bench_writes++;
+    return __real_writev(fd, iov, n);
+}
+
+
+ssize_t
+__wrap_pwrite(int fd, const void *buf, size_t n, off_t offset)
+{
+    ngx_bench_writes++;
+    return __real_pwrite(fd, buf, n, offset);
+}
+
+
+ssize_t
+__wrap_pwritev(int fd, const struct iovec *iov, int n, off_t offset)
+{
+    ngx_bench_writes++;
+    return __real_pwritev(fd, iov, n, offset);
+}
+
+
+void *
+__wrap_ngx_alloc(size_t size, ngx_log_t *log)
+{
+    ngx_bench_allocs++;
+    ngx_bench_allocated += size;
+
+    return __real_ngx_alloc(size, log);
+}
+
+
+void *
+__wrap_ngx_memalign(size_t alignment, size_t size, ngx_log_t *log)
+{
+    ngx_bench_allocs++;
+    ngx_bench_allocated += size;
+
+    return __real_ngx_memalign(alignment, size, log);
+}
+
+
+void
+__wrap_ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_bench_finalized = rc;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+
+# builds and runs the request body benchmark, ngx_http_request_body_bench.c,
+# in an nginx source tree configured and built with the request body code:
+#
+#     sh ngx_http_request_body_bench.sh <nginx dir> [body_bench options]
+#
+# the harness is linked with all the objects of objs/Makefile but nginx.o,
+# the libraries are those of the nginx link command
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)/ngx_http_request_body_bench.c
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <nginx dir> [-n requests] [-s size] [-g gigabytes]" \
+         "[-t dir]" >&2
+    exit 1
+fi
+
+cd "$1"
+shift
+
+if [ ! -f objs/Makefile ] || [ ! -f objs/nginx ]; then
+    echo "$0: no objs/nginx, run ./configure and make first" >&2
+    exit 1
+fi
+
+make_var() {
+    sed -n "s/^$1[[:space:]]*=[[:space:]]*//p" objs/Makefile | head -1
+}
+
+CC=$(make_var CC)
+CFLAGS=$(make_var CFLAGS)
+
+# the include directories, one per line after "ALL_INCS = "
+
+INCS=$(sed -n '/^ALL_INCS[[:space:]]*=/,/^[[:space:]]*$/p' objs/Makefile \
+       | tr -d '\\' | sed "s/^ALL_INCS[[:space:]]*=//" | tr '\n\t' '  ')
+
+# the link command up to the empty line, without the objects and the output
+
+LIBS=$(sed -n '/\$(LINK) -o objs\/nginx/,/^[[:space:]]*$/p' objs/Makefile \
+       | tr -d '\\' | tr '\t' ' ' | tr ' ' '\n' \
+       | grep -v -e '^$' -e '\.o$' -e '^\$(LINK)$' \
+                 -e '^-o$' -e '^objs/nginx$' \
+       | tr '\n' ' ')
+
+OBJS=$(find objs -name '*.o' ! -name nginx.o ! -name body_bench.o)
+
+echo "building objs/body_bench"
+
+$CC -c $CFLAGS $INCS -o objs/body_bench.o "$bench"
+
+$CC -o objs/body_bench objs/body_bench.o $OBJS \
+    -Wl,--wrap=ngx_alloc,--wrap=ngx_memalign \
+    -Wl,--wrap=ngx_http_finalize_request \
+    -Wl,--wrap=write,--wrap=writev,--wrap=pwrite,--wrap=pwritev \
+    $LIBS
+
+exec objs/body_bench "$@"